@@ -15,16 +15,17 @@ struct BFile : virtual public Bounded, virtual public Identifiable,
  private:
   int deleted_level_;
   BFileType type_;
+  bool reserved_;
   leveldb::FileMetaData* file_meta_;
  public:
   // for deletion only.
   BFile(leveldb::FileMetaData* f)
   : Statistics(),
-    deleted_level_(-1), type_(TypeHole),
+    deleted_level_(-1), type_(TypeHole), reserved_(false),
     file_meta_(f) { f->refs++; } 
   BFile(leveldb::FileMetaData* f, const Statistics& init) 
   : Statistics(init), 
-    deleted_level_(-1), type_(TypeHole),
+    deleted_level_(-1), type_(TypeHole), reserved_(false),
     file_meta_(f) { f->refs++; }
   virtual ~BFile() {
     if (file_meta_ && --file_meta_->refs <= 0)
@@ -42,6 +43,9 @@ struct BFile : virtual public Bounded, virtual public Identifiable,
   int DeletedLevel() const { return deleted_level_; }
   void SetType(BFileType type) { type_ = type; }
   BFileType Type() const { return type_; }
+  // Reserved files are inputs of a running compaction.
+  void SetReserved(bool reserved) { reserved_ = reserved; }
+  bool Reserved() const { return reserved_; }
 
   using Statistics::UpdateTime;
   using Statistics::UpdateStatistics;
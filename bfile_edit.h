@@ -3,6 +3,7 @@
 #include "../../db/version_edit.h"
 #include "bfile.h"
 #include <memory>
+#include <algorithm>
 #include <sstream>
 
 namespace sagitrs {
@@ -10,22 +11,42 @@ namespace sagitrs {
 struct BFileEdit {
   std::vector<leveldb::FileMetaData*> deleted_;
   std::vector<leveldb::FileMetaData*> generated_;
+  // files moved down a height without rewrite, see SubSBS::BuildMove().
+  std::vector<leveldb::FileMetaData*> moved_;
  public:
-  BFileEdit() : deleted_(), generated_() {}
+  BFileEdit() : deleted_(), generated_(), moved_() {}
   //explicit BFileEdit(const VersionEdit& edit, Version* base);
   uint64_t Hash() const {
     uint64_t hash = 0;
     for (auto& file : deleted_) 
       hash += file->number;
+    for (auto& file : moved_) 
+      hash += file->number;
     //assert(generated_.size() <= 1 || hash > 0);
     return hash;
   }
   void Add(leveldb::FileMetaData* f) { generated_.push_back(f); }
   void Del(leveldb::FileMetaData* f) { deleted_.push_back(f); }
+  void Move(leveldb::FileMetaData* f) { moved_.push_back(f); }
+  bool IsTrivialMove() const { 
+    return moved_.size() == 1 && deleted_.empty() && generated_.empty(); 
+  }
   void Dels(const std::vector<leveldb::FileMetaData*>& files) { 
     for (auto file : files) 
       Del(file); 
   }
+  // Collect the result of a subcompaction. Inputs deleted or moved by more
+  // than one subcompaction are recorded once.
+  void Merge(const BFileEdit& edit) {
+    for (auto file : edit.deleted_)
+      if (std::find(deleted_.begin(), deleted_.end(), file) == deleted_.end())
+        Del(file);
+    for (auto file : edit.generated_)
+      Add(file);
+    for (auto file : edit.moved_)
+      if (std::find(moved_.begin(), moved_.end(), file) == moved_.end())
+        Move(file);
+  }
   std::string ToString() const {
     std::stringstream ss;
     ss << "BFileEdit={";
@@ -35,6 +56,9 @@ struct BFileEdit {
     for (auto file : generated_) {
       ss << "+" << file->number << ",";
     }
+    for (auto file : moved_) {
+      ss << ">" << file->number << ",";
+    }
     ss << "}";
     return ss.str();
   }
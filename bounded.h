@@ -91,6 +91,18 @@ struct Bounded {
   }
 };
 
+// Bounds viewing keys owned by the caller, who keeps them alive while
+// the bounds are used. Seeking by a key does not copy it.
+struct SliceBounded : virtual public Bounded {
+ private:
+  Slice min_, max_;
+ public:
+  SliceBounded(const Slice& min, const Slice& max) : min_(min), max_(max) {}
+  virtual ~SliceBounded() {}
+  virtual Slice Min() const override { return min_; }
+  virtual Slice Max() const override { return max_; }
+};
+
 struct RealBounded : virtual public Bounded {
  private:
   std::string min_, max_;
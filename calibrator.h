@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include "lockable.h"
+
+namespace sagitrs {
+
+// Constants of the cost model used to assign HoleFileCapacity in
+// SBSIterator::UpdateTable(). A hole file that covers i more runs saves
+// write cost alpha * width * write * key_size / i / (i + 1), and costs
+// page_size * block_fraction * (bloom_fp * get + iterate) / 2 more reads.
+struct CostModel {
+  enum Policy { Balanced, ReadOptimized, WriteOptimized, ScanOptimized };
+  // extra writes per byte of a compaction.
+  double alpha_ = 0.5;
+  double page_size_ = 4096;
+  // bloom filter false positive rate.
+  double bloom_fp_ = 0.001;
+  // fraction of probes that read a block from the device.
+  double block_fraction_ = 0.5;
+  // weights of the write, get and iterate costs.
+  double write_weight_ = 1;
+  double read_weight_ = 1;
+  double scan_weight_ = 1;
+
+  static CostModel ForPolicy(Policy policy) {
+    CostModel model;
+    switch (policy) {
+    case ReadOptimized:  model.read_weight_ = 4; break;
+    case WriteOptimized: model.write_weight_ = 4; break;
+    case ScanOptimized:  model.scan_weight_ = 4; break;
+    default: break;
+    }
+    return model;
+  }
+};
+
+// Running estimates of the cost model constants from the I/O the DB
+// actually observes. Every estimate is an exponential moving average,
+// and is only applied after MinSamples() observations and within
+// [1/MaxDrift(), MaxDrift()] times the configured value, so a burst of
+// unusual I/O cannot move the market far.
+struct CostCalibrator : public Lockable {
+ private:
+  struct Estimate {
+    double value_ = 0;
+    uint64_t samples_ = 0;
+    void Add(double value, double weight) {
+      value_ = samples_ ? value_ + weight * (value - value_) : value;
+      samples_ ++;
+    }
+  };
+  double weight_;
+  uint64_t min_samples_;
+  double max_drift_;
+  // compaction bytes per second that alpha is configured for.
+  double nominal_rate_;
+  Estimate rate_, bloom_fp_, block_fraction_, page_size_;
+
+  double Bound(const Estimate& e, double base) const {
+    if (e.samples_ < min_samples_ || base <= 0) return base;
+    return std::min(std::max(e.value_, base / max_drift_), base * max_drift_);
+  }
+ public:
+  CostCalibrator(double weight = 0.05, uint64_t min_samples = 16, 
+                 double max_drift = 4, double nominal_rate = 64 << 20)
+  : weight_(weight), min_samples_(min_samples), max_drift_(max_drift),
+    nominal_rate_(nominal_rate) {}
+
+  uint64_t MinSamples() const { return min_samples_; }
+  double MaxDrift() const { return max_drift_; }
+
+  // A compaction wrote bytes in micros.
+  void RecordCompaction(uint64_t bytes, uint64_t micros) {
+    if (bytes == 0 || micros == 0) return;
+    LockGuard guard(this, LockGuard::WriteLock);
+    rate_.Add(1e6 * bytes / micros, weight_);
+  }
+  // A get checked the filters of probes files, and read a data block of 
+  // wasted files that did not contain the key.
+  void RecordGet(uint64_t probes, uint64_t wasted) {
+    if (probes == 0) return;
+    LockGuard guard(this, LockGuard::WriteLock);
+    bloom_fp_.Add(1.0 * wasted / probes, weight_);
+  }
+  // Block reads, of which misses went to the device with bytes in total.
+  void RecordBlockReads(uint64_t reads, uint64_t misses, uint64_t bytes) {
+    if (reads == 0) return;
+    LockGuard guard(this, LockGuard::WriteLock);
+    block_fraction_.Add(1.0 * misses / reads, weight_);
+    if (misses > 0)
+      page_size_.Add(1.0 * bytes / misses, weight_);
+  }
+
+  // The configured model with calibrated constants. Slower compactions
+  // make writes more expensive, so alpha grows with nominal / observed rate.
+  CostModel Calibrate(const CostModel& base) {
+    LockGuard guard(this, LockGuard::ReadLock);
+    CostModel model = base;
+    if (rate_.samples_ >= min_samples_ && rate_.value_ > 0) {
+      Estimate alpha;
+      alpha.Add(base.alpha_ * nominal_rate_ / rate_.value_, 1);
+      alpha.samples_ = rate_.samples_;
+      model.alpha_ = Bound(alpha, base.alpha_);
+    }
+    model.bloom_fp_ = Bound(bloom_fp_, base.bloom_fp_);
+    model.block_fraction_ = Bound(block_fraction_, base.block_fraction_);
+    model.page_size_ = Bound(page_size_, base.page_size_);
+    return model;
+  }
+};
+
+}
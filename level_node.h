@@ -5,11 +5,15 @@
 #include <stack>
 #include <memory>
 #include <array>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
 #include "db/dbformat.h"
 #include "bounded.h"
 #include "bounded_value_container.h"
 #include "options.h"
 #include "statistics.h"
+#include "lockable.h"
 namespace sagitrs {
 struct SBSNode;
 typedef BFileVec TypeBuffer;
@@ -45,6 +49,11 @@ enum TableVariableName : uint32_t {
   FileNumScore,
   FileDynamicScore,
   NodeWidthScore,
+  // probes gets waste in the buffer, against the bytes to merge it.
+  ReadSeekScore,
+  // deletion entries in the subtree, and per mille of the buffer.
+  LocalDelete,
+  TombstoneDensity,
   // important args.
   HoleFileCapacity,
   MinHoleFileSize,
@@ -52,6 +61,142 @@ enum TableVariableName : uint32_t {
   TableVariableMax,
 };
 
+// A leaf file remembered by HotRanges. The file may be compacted and
+// deleted while it is remembered, so its number and range are kept by value.
+struct HotRange : public RealBounded {
+  uint64_t id_;
+  int64_t count_;
+  HotRange(const BFile& file, int64_t count) 
+  : RealBounded(file.Min(), file.Max()), id_(file.Identifier()), count_(count) {}
+};
+
+// Top-K hottest leaf files (by KSGetCount) of a subtree, in descending order.
+// Built by merging the children's lists, and kept up to date by offering
+// the new count of a leaf whenever it is read (Space-Saving style), so the
+// hottest ranges of any subtree can be read without walking it.
+struct HotRanges : public std::vector<HotRange> {
+  size_t capacity_;
+  int64_t time_;
+  bool valid_;
+  HotRanges() : capacity_(0), time_(0), valid_(false) {}
+  bool Valid(int64_t time) const { return valid_ && time_ == time; }
+  void Invalidate() { valid_ = false; }
+  void Reset(size_t capacity, int64_t time) {
+    clear();
+    capacity_ = capacity;
+    time_ = time;
+    valid_ = true;
+  }
+  // Insert or update the count of a file, keeping at most capacity_ records.
+  void Offer(const BFile& file, int64_t count) {
+    iterator p = Find(file.Identifier());
+    if (p != end()) {
+      p->count_ = count;
+      Sift(p);
+    } else if (size() < capacity_ || (!empty() && rbegin()->count_ < count)) 
+      Offer(HotRange(file, count));
+  }
+  void Offer(const HotRange& range) {
+    iterator p = Find(range.id_);
+    if (p != end()) 
+      p->count_ = range.count_;
+    else if (size() < capacity_) 
+      p = insert(end(), range);
+    else if (!empty() && rbegin()->count_ < range.count_) 
+      *(p = end() - 1) = range;
+    else 
+      return;
+    Sift(p);
+  }
+  void Merge(const HotRanges& hot) {
+    for (auto& range : hot) 
+      Offer(range);
+  }
+  void Remove(uint64_t id) {
+    iterator p = Find(id);
+    if (p != end()) 
+      erase(p);
+  }
+  const HotRange* Hottest() const { return empty() ? nullptr : &front(); }
+ private:
+  iterator Find(uint64_t id) {
+    iterator p = begin();
+    for (; p != end(); ++p)
+      if (p->id_ == id) 
+        break;
+    return p;
+  }
+  // bubble the updated record into place.
+  void Sift(iterator p) {
+    for (; p != begin() && (p - 1)->count_ < p->count_; --p)
+      std::swap(*p, *(p - 1));
+    for (; p + 1 != end() && p->count_ < (p + 1)->count_; ++p)
+      std::swap(*p, *(p + 1));
+  }
+};
+
+struct LevelNode;
+// Scores of all inner level nodes, ordered, so the node with the highest
+// score can be picked without scanning the tree. Level nodes register
+// themselves when they are put into a SBSNode, mark themselves dirty when
+// their buffer or statistics change, and remove themselves when deleted.
+// Only dirty level nodes are scored again before a pick.
+struct ScoreIndex {
+  std::set<std::pair<double, LevelNode*>> heap_;
+  std::unordered_set<LevelNode*> dirty_;
+  // time slice of the last full refresh.
+  int64_t time_;
+  ScoreIndex() : heap_(), dirty_(), time_(-1) {}
+  ~ScoreIndex();
+  void SetDirty(LevelNode* lnode);
+  void Remove(LevelNode* lnode);
+  // Negative score means the level node could not be picked.
+  void Update(LevelNode* lnode, double score);
+  LevelNode* Top() const { return heap_.empty() ? nullptr : heap_.rbegin()->second; }
+};
+
+// Where every file of the tree is: file number to the file and the
+// (node, height) holding it, so a file is found without scanning buffers.
+// Level nodes register their files when they are put into a SBSNode, keep
+// them up to date in Add(), Pop() and Absorb(), and drop the files still
+// pointing to them when they are taken out. 
+struct FileIndex : public Lockable {
+  struct Entry {
+    BFile* file_;
+    SBSNode* node_;
+    size_t height_;
+  };
+  std::unordered_map<uint64_t, Entry> map_;
+  // set when the tree is destroyed, files may be released before nodes.
+  bool closed_;
+  FileIndex() : map_(), closed_(false) {}
+  void Set(BFile* file, LevelNode* lnode);
+  // Erase file if it is still registered by lnode.
+  void Erase(const BFile& file, LevelNode* lnode);
+  void Attach(LevelNode* lnode);
+  void Detach(LevelNode* lnode);
+  bool Find(uint64_t id, Entry& entry) {
+    LockGuard guard(this, LockGuard::ReadLock);
+    auto p = map_.find(id);
+    if (p == map_.end()) return false;
+    entry = p->second;
+    return true;
+  }
+  bool Contains(uint64_t id) {
+    LockGuard guard(this, LockGuard::ReadLock);
+    return map_.find(id) != map_.end();
+  }
+  size_t Size() {
+    LockGuard guard(this, LockGuard::ReadLock);
+    return map_.size();
+  }
+  void Close() {
+    LockGuard guard(this, LockGuard::WriteLock);
+    closed_ = true;
+    map_.clear();
+  }
+};
+
 struct LevelNode : public Printable {
   // next node of this level.
   std::atomic<SBSNode*> next_;
@@ -65,14 +210,14 @@ struct LevelNode : public Printable {
    public:
     uint64_t update_time_;
     Statistics *stats_; 
-    BFile* hottest_;
+    HotRanges hot_;
     double max_runs_;
 
     VariableTable(const StatisticsOptions& stat_options) :
       std::array<uint64_t, TableVariableMax>(),
       update_time_(0),
       stats_(nullptr), 
-      hottest_(nullptr),
+      hot_(),
       max_runs_(0) {}
 
     // Copy
@@ -80,7 +225,7 @@ struct LevelNode : public Printable {
       std::array<uint64_t, TableVariableMax>(table),
       stats_(nullptr),
       update_time_(0),
-      hottest_(nullptr),
+      hot_(),
       max_runs_(0) {}
 
     virtual ~VariableTable() { SetDirty(); }
@@ -103,9 +248,9 @@ struct LevelNode : public Printable {
       //if (!isStatisticsDirty());
       if (stats_)
         stats_->GetStringSnapshot(set);
-      if (hottest_) {
-        set.emplace_back("UTime", std::to_string(update_time_));
-        set.emplace_back("KSGet", std::to_string(hottest_->GetStatistics(KSGetCount, update_time_)));
+      if (hot_.valid_ && !hot_.empty()) {
+        set.emplace_back("UTime", std::to_string(hot_.time_));
+        set.emplace_back("KSGet", std::to_string(hot_.front().count_));
       }
       {
         set.emplace_back("\nCoreArgs", "\n");
@@ -129,23 +274,49 @@ struct LevelNode : public Printable {
         set.emplace_back("NumS", std::to_string(at(FileNumScore)));
         set.emplace_back("DynamicS", std::to_string(at(FileDynamicScore)));
         set.emplace_back("WidthS", std::to_string(at(NodeWidthScore)));
+        set.emplace_back("SeekS", std::to_string(at(ReadSeekScore)));
+        set.emplace_back("TombD", std::to_string(at(TombstoneDensity)));
       }
     }
   };
   VariableTable table_;
+  // where this level node is placed, set by SBSNode::SetLevel().
+  SBSNode* owner_;
+  size_t height_;
+  // score index membership.
+  ScoreIndex* index_;
+  bool indexed_;
+  double score_;
+  // this subtree is the region of a running compaction. Copies and
+  // absorbs keep it, SubSBS::Build() clears it.
+  bool reserved_;
+  // set while this level node is in a SBSNode, see FileIndex.
+  FileIndex* files_;
 
   // Build blank node.
   LevelNode(const StatisticsOptions& stat_options, 
             SBSNode* next) 
   : next_(next), 
     buffer_(), 
-    table_(stat_options) {}
+    table_(stat_options),
+    owner_(nullptr), height_(0),
+    index_(nullptr), indexed_(false), score_(0),
+    reserved_(false), files_(nullptr) {}
   // Copy existing node.
   LevelNode(const LevelNode& node):
     next_(node.next_.load(std::memory_order_relaxed)),
     buffer_(node.buffer_),
-    table_(node.table_) {}
-  ~LevelNode() {}
+    table_(node.table_),
+    owner_(nullptr), height_(0),
+    index_(nullptr), indexed_(false), score_(0),
+    reserved_(node.reserved_), files_(nullptr) {}
+  ~LevelNode() { 
+    if (index_) index_->Remove(this); 
+  }
+  void SetDirty() {
+    table_.SetDirty();
+    if (index_) index_->SetDirty(this);
+  }
 
   void ReleaseAll() {
     for (auto file : buffer_)
@@ -153,13 +324,15 @@ struct LevelNode : public Printable {
   }
   void Add(BFile* value) {
     buffer_.Add(value); 
-    table_.SetDirty();
+    if (files_) files_->Set(value, this);
+    SetDirty();
     //table_.tree_->MergeStatistics(*value); 
   }
   BFile* Pop(const BFile& value) { 
     // warning: memory leak.
     auto res = buffer_.Pop(value.Identifier()); 
-    table_.SetDirty();
+    if (files_ && res) files_->Erase(*res, this);
+    SetDirty();
     return res;
   }
   bool Contains(const BFile& value) const { 
@@ -171,7 +344,11 @@ struct LevelNode : public Printable {
     next_.store(target->next_, std::memory_order_relaxed);
     //next_ = target->next_;
     buffer_.AddAll(target->buffer_);
-    table_.SetDirty();
+    reserved_ = reserved_ || target->reserved_;
+    if (files_) 
+      for (auto file : target->buffer_)
+        files_->Set(file, this);
+    SetDirty();
   }
   
   virtual void GetStringSnapshot(std::vector<KVPair>& set) const override {
@@ -181,4 +358,53 @@ struct LevelNode : public Printable {
 
 };
 
+inline void FileIndex::Set(BFile* file, LevelNode* lnode) {
+  LockGuard guard(this, LockGuard::WriteLock);
+  if (closed_) return;
+  map_[file->Identifier()] = Entry{file, lnode->owner_, lnode->height_};
+}
+inline void FileIndex::Erase(const BFile& file, LevelNode* lnode) {
+  LockGuard guard(this, LockGuard::WriteLock);
+  if (closed_) return;
+  auto p = map_.find(file.Identifier());
+  if (p != map_.end() && p->second.node_ == lnode->owner_ && p->second.height_ == lnode->height_)
+    map_.erase(p);
+}
+inline void FileIndex::Attach(LevelNode* lnode) {
+  lnode->files_ = this;
+  for (auto file : lnode->buffer_)
+    Set(file, lnode);
+}
+inline void FileIndex::Detach(LevelNode* lnode) {
+  if (lnode->files_ != this) return;
+  lnode->files_ = nullptr;
+  if (closed_) return;
+  for (auto file : lnode->buffer_)
+    Erase(*file, lnode);
+}
+
+inline ScoreIndex::~ScoreIndex() {
+  for (auto lnode : dirty_) lnode->index_ = nullptr;
+  for (auto& p : heap_) p.second->index_ = nullptr;
+}
+inline void ScoreIndex::SetDirty(LevelNode* lnode) {
+  lnode->index_ = this;
+  dirty_.insert(lnode);
+}
+inline void ScoreIndex::Remove(LevelNode* lnode) {
+  if (lnode->indexed_) 
+    heap_.erase(std::make_pair(lnode->score_, lnode));
+  lnode->indexed_ = false;
+  dirty_.erase(lnode);
+  lnode->index_ = nullptr;
+}
+inline void ScoreIndex::Update(LevelNode* lnode, double score) {
+  if (lnode->indexed_) 
+    heap_.erase(std::make_pair(lnode->score_, lnode));
+  lnode->indexed_ = score >= 0;
+  lnode->score_ = score;
+  if (lnode->indexed_)
+    heap_.emplace(score, lnode);
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include "level_node.h"
+
+namespace sagitrs {
+
+// Structured export of the VariableTable of every node, so the tree can be
+// scraped instead of parsing PrintList()/PrintSimple() output.
+// Usage:
+//   MetricsCollector collector;
+//   list.CollectMetrics(collector);
+//   collector.PrintPrometheus(os);   // or collector.PrintJSON(os);
+// In incremental mode, per-node gauges are only emitted when one of their
+// values changed since the previous collection; per-height gauges are
+// always emitted. Nodes missing from a collection are forgotten, so a node
+// that comes back with the same guard is emitted again.
+struct MetricsCollector {
+  struct Gauge {
+    TableVariableName variable_;
+    const char* name_;
+    const char* help_;
+  };
+  static const std::vector<Gauge>& Gauges() {
+    static const std::vector<Gauge> gauges = {
+      {LocalGet,         "local_get",          "Get operations per minute."},
+      {LocalWrite,       "local_write",        "Put operations per minute."},
+      {LocalIterate,     "local_iterate",      "Iterate operations per minute."},
+      {HoleFileCount,    "hole_file_count",    "Hole files in buffer."},
+      {TapeFileCount,    "tape_file_count",    "Tape files in buffer."},
+      {HoleFileSize,     "hole_file_bytes",    "Bytes of hole files in buffer."},
+      {TapeFileSize,     "tape_file_bytes",    "Bytes of tape files in buffer."},
+      {HoleFileRuns,     "hole_file_runs",     "Child runs covered by hole files."},
+      {TapeFileRuns,     "tape_file_runs",     "Child runs covered by tape files."},
+      {HoleFileCapacity, "hole_file_capacity", "Hole file capacity, in 1/100 runs."},
+      {FileSizeScore,    "file_size_score",    "File size score."},
+      {FileRunScore,     "file_run_score",     "File run score."},
+      {FileNumScore,     "file_num_score",     "File num score."},
+      {NodeWidthScore,   "node_width_score",   "Node width score."},
+      {ReadSeekScore,    "read_seek_score",    "Read-triggered compaction score."},
+      {LocalDelete,      "local_delete",       "Deletion entries in subtree."},
+      {TombstoneDensity, "tombstone_density",  "Deletion entries in buffer, per mille."},
+    };
+    return gauges;
+  }
+  struct Sample {
+    std::string name_;
+    std::string guard_;
+    int height_;      // -1 for global samples.
+    bool per_node_;
+    double value_;
+  };
+ private:
+  struct LastValues {
+    // the collection the node was last seen in.
+    uint64_t collection_;
+    std::vector<uint64_t> values_;
+  };
+  bool incremental_;
+  uint64_t collection_;
+  std::vector<Sample> samples_;
+  std::map<std::pair<std::string, int>, LastValues> last_;
+  std::map<int, std::vector<double>> heights_;
+ public:
+  explicit MetricsCollector(bool incremental = false)
+  : incremental_(incremental), collection_(0), samples_(), last_(), heights_() {}
+
+  const std::vector<Sample>& Samples() const { return samples_; }
+  // Drop the samples of last collection, keep the incremental state.
+  void Reset() {
+    samples_.clear();
+    heights_.clear();
+    collection_ ++;
+  }
+  void AddNode(const Slice& guard, size_t height, const LevelNode::VariableTable& table) {
+    auto& gauges = Gauges();
+    std::vector<uint64_t> values;
+    for (auto& g : gauges)
+      values.push_back(table[g.variable_]);
+
+    auto& sum = heights_[height];
+    if (sum.empty()) sum.resize(gauges.size() + 1, 0);
+    for (size_t i = 0; i < gauges.size(); ++i)
+      sum[i] += values[i];
+    sum[gauges.size()] ++;
+
+    std::string key = guard.ToString();
+    if (incremental_) {
+      auto& last = last_[std::make_pair(key, (int)height)];
+      last.collection_ = collection_;
+      if (last.values_ == values) return;
+      last.values_ = values;
+    }
+    for (size_t i = 0; i < gauges.size(); ++i)
+      samples_.push_back(Sample{gauges[i].name_, key, (int)height, true, (double)values[i]});
+  }
+  void AddGlobal(const std::string& name, double value) {
+    samples_.push_back(Sample{name, "", -1, false, value});
+  }
+  // Per-height sums are emitted as "height_<gauge>", and the number of nodes
+  // in a height as "height_nodes".
+  void Finish() {
+    auto& gauges = Gauges();
+    for (auto& p : heights_) {
+      for (size_t i = 0; i < gauges.size(); ++i)
+        samples_.push_back(Sample{std::string("height_") + gauges[i].name_, "", p.first, false, p.second[i]});
+      samples_.push_back(Sample{"height_nodes", "", p.first, false, p.second[gauges.size()]});
+    }
+    heights_.clear();
+    for (auto p = last_.begin(); p != last_.end(); )
+      if (p->second.collection_ != collection_)
+        p = last_.erase(p);
+      else 
+        ++p;
+  }
+
+  void PrintPrometheus(std::ostream& os, const std::string& prefix = "sbs_") const {
+    std::map<std::string, std::vector<const Sample*>> groups;
+    for (auto& s : samples_)
+      groups[s.name_].push_back(&s);
+    for (auto& g : groups) {
+      for (auto& gauge : Gauges())
+        if (g.first == gauge.name_ || g.first == std::string("height_") + gauge.name_)
+          os << "# HELP " << prefix << g.first << " " << gauge.help_ << "\n";
+      os << "# TYPE " << prefix << g.first << " gauge\n";
+      for (auto s : g.second) {
+        os << prefix << g.first;
+        if (s->height_ >= 0) {
+          os << "{height=\"" << s->height_ << "\"";
+          if (s->per_node_)
+            os << ",guard=\"" << Escape(s->guard_) << "\"";
+          os << "}";
+        }
+        os << " ";
+        PrintValue(os, s->value_);
+        os << "\n";
+      }
+    }
+  }
+  void PrintJSON(std::ostream& os) const {
+    os << "[";
+    for (size_t i = 0; i < samples_.size(); ++i) {
+      auto& s = samples_[i];
+      os << (i ? "," : "") << "{\"name\":\"" << s.name_ << "\"";
+      if (s.height_ >= 0)
+        os << ",\"height\":" << s.height_;
+      if (s.per_node_)
+        os << ",\"guard\":\"" << Escape(s.guard_) << "\"";
+      os << ",\"value\":";
+      PrintValue(os, s.value_);
+      os << "}";
+    }
+    os << "]";
+  }
+ private:
+  // Byte and entry counts are integral and must not be rounded to the 
+  // default 6 significant digits, other values keep full precision.
+  static void PrintValue(std::ostream& os, double value) {
+    if (value == std::floor(value) && std::fabs(value) < 1e15) {
+      os << (int64_t)value;
+      return;
+    }
+    auto precision = os.precision(17);
+    os << value;
+    os.precision(precision);
+  }
+  // Guards are user keys and may be binary. The result is valid both as a
+  // Prometheus label value and as a JSON string.
+  static std::string Escape(const std::string& key) {
+    std::stringstream ss;
+    for (unsigned char ch : key) {
+      if (ch == '"' || ch == '\\')
+        ss << '\\' << ch;
+      else if (ch < 0x20 || ch >= 0x7f)
+        ss << "\\\\x" << std::hex << std::setw(2) << std::setfill('0') << (int)ch << std::dec;
+      else
+        ss << ch;
+    }
+    return ss.str();
+  }
+};
+
+}
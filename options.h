@@ -5,12 +5,17 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
+#include <atomic>
 #include "leveldb/env.h"
 
 #include "sampler.h"
+#include "calibrator.h"
 
 namespace sagitrs {
 
+struct ScoreIndex;
+struct FileIndex;
+
 #define STATISTICS_PREVIOUS  1
 #define STATISTICS_CURRENT   0
 #define STATISTICS_ALL      -1
@@ -34,6 +39,9 @@ enum DefaultTypeLabel : uint32_t {
   // clear at Compaction.
   KSPutCount,
   KSBytesCount,
+  KSDeleteCount,
+  // to record deletion entries of a file.
+  // Set from flush and compaction output metadata.
   PutCount,
   // for special usage.
   // recording total put operations globally.
@@ -45,6 +53,8 @@ struct SBSNodeOptions {
  private:
  public:
   static const size_t BaseWidth = 9;
+  // Levels a SBSNode has room for, the head grows up to this height.
+  static constexpr size_t MaxTreeHeight = 12;
   size_t width_[3] = {BaseWidth * 2 / 3, BaseWidth, BaseWidth * 4 / 3};
   // The width of each layer of the node, except for the Head node, 
   // must not be LOWER than this value.
@@ -72,13 +82,35 @@ struct SBSNodeOptions {
   }
 };
 
+// Source of time of the statistics. By default Env::Default() is read,
+// simulators and benchmarks install a ManualClock and advance it 
+// themselves, so time slices pass as fast as the workload is replayed.
+struct Clock {
+  virtual ~Clock() {}
+  virtual uint64_t NowMicros() const = 0;
+};
+struct ManualClock : public Clock {
+ private:
+  std::atomic<uint64_t> now_;
+ public:
+  explicit ManualClock(uint64_t now = 0) : now_(now) {}
+  virtual uint64_t NowMicros() const override { return now_.load(std::memory_order_relaxed); }
+  void Advance(uint64_t micros) { now_.fetch_add(micros, std::memory_order_relaxed); }
+  void Set(uint64_t now) { now_.store(now, std::memory_order_relaxed); }
+};
+
 struct StatisticsOptions {
+  enum StatisticsType { TimeSliceQueue, DecayedAverage };
  private:
   static leveldb::Env* TimerEnv() { return leveldb::Env::Default(); }
+  // shared by all copies of the options, must outlive them.
+  Clock* clock_ = nullptr;
   size_t time_slice_ = 5 * 1000 * 1000;
   size_t time_count_ = 10;
   size_t time_slice_before_merge_ = 2;
   double B = 0.1, I = 0.9, D = 0.0;
+  StatisticsType statistics_type_ = TimeSliceQueue;
+  double half_life_ = 4;
  public:
   virtual size_t StatisticsLabelMax() const { return DefaultCounterTypeMax; }
   
@@ -96,7 +128,12 @@ struct StatisticsOptions {
 
   // Env::NowMicros() is needed to get the current time 
   // to determine which time slice the data is saved in.
-  virtual uint64_t NowTimeSlice() const { return TimerEnv()->NowMicros() / time_slice_; }
+  virtual uint64_t NowTimeSlice() const { return NowMicros() / time_slice_; }
+  uint64_t NowMicros() const { 
+    return clock_ ? clock_->NowMicros() : TimerEnv()->NowMicros(); 
+  }
+  // Read time from clock instead of Env::Default(), nullptr to reset.
+  void SetClock(Clock* clock) { clock_ = clock; }
 
   // We have the following ways to obtain statistics for a time slice.
   // 1. L = getting the most recent complete time slice record.
@@ -118,6 +155,21 @@ struct StatisticsOptions {
   // and I personally recommend setting it to 0, 
   // even if the mechanism associated with it works properly.
   virtual double kDifferentiationWeight() const { return D; }
+
+  // How the time-sliced records are kept.
+  // 1. TimeSliceQueue keeps the last TimeSliceMaximumSize() slices
+  // separately in a TTLQueue.
+  // 2. DecayedAverage keeps only the current slice and an exponentially
+  // weighted moving average of all completed slices, so memory is
+  // constant and merging two records is a weighted add.
+  virtual StatisticsType StatisticsBackend() const { return statistics_type_; }
+  void SetStatisticsBackend(StatisticsType type) { statistics_type_ = type; }
+
+  // Number of time slices after which an old record weighs half as much
+  // in the DecayedAverage backend.
+  virtual double HalfLifeTimeSlice() const { return half_life_; }
+  void SetHalfLifeTimeSlice(double half_life) { half_life_ = half_life; }
+  double DecayPerTimeSlice() const { return std::pow(0.5, 1.0 / HalfLifeTimeSlice()); }
 };
 
 struct CompactionOptions {
@@ -126,7 +178,11 @@ struct CompactionOptions {
   //    sample_per_file_(options.MaxFileSize() / options.CompactSampleConst() / PageConst),
   //    sample_per_output_file_(sample_per_file_ / OutputFileMinConst),
   //    force_pick_(true) {}
-  sagitrs::SamplerTable* table_;
+  sagitrs::SamplerTable* table_ = nullptr;
+  // Set by SBSkiplist when the incremental score index is used.
+  ScoreIndex* score_index_ = nullptr;
+  // Set by SBSkiplist when files are indexed by number.
+  FileIndex* file_index_ = nullptr;
 };
 struct SBSOptions : public SBSNodeOptions, 
                     public StatisticsOptions,
@@ -140,7 +196,8 @@ struct SBSOptions : public SBSNodeOptions,
   size_t MaxFileSize() const { return 4 << 20; }
   size_t Width() const { return SBSNodeOptions::BaseWidth; }
 
-  size_t kMaxHeight() const { return 6; }
+  // Height of the head of a new tree, at most MaxTreeHeight.
+  static constexpr size_t kMaxHeight() { return 6; }
 
   double SpaceAmplificationConst() const { return 0.5; }
   double CacheCapacity() const { return 0.3; }
@@ -153,10 +210,27 @@ struct SBSOptions : public SBSNodeOptions,
   inline size_t IterateSampleConst() const { return 1; }
   inline size_t CompactSampleConst() const { return 10; }
   
+  // Number of hottest leaf files remembered by each subtree.
+  size_t HotRangeCount() const { return 8; }
+
   size_t level0_compaction_size_ = 8;
   inline size_t Level0CompactionSize() const { return level0_compaction_size_; }
   inline double SlowDownScore() const { return 1.85; }
   inline double StopScore() const { return 1.95; }
+  // Bytes of compaction that one wasted probe of a get is worth, the
+  // gets of a minute can trigger a compaction. 0 to disable.
+  size_t seek_compaction_bytes_ = 40 << 10;
+  inline size_t SeekCompactionBytes() const { return seek_compaction_bytes_; }
+  // Fraction of deletion entries in a buffer at which it is compacted,
+  // pushing tombstones down to where they can be dropped. 0 to disable.
+  double tombstone_compaction_density_ = 0.5;
+  inline double TombstoneCompactionDensity() const { return tombstone_compaction_density_; }
+  // Pending compaction bytes at which writes are slowed down and stopped,
+  // and the range of write rates, see WriteController.
+  inline uint64_t PendingBytesSlowDown() const { return 4ULL << 30; }
+  inline uint64_t PendingBytesStop() const { return 16ULL << 30; }
+  inline double MaxWriteRate() const { return 256 << 20; }
+  inline double MinWriteRate() const { return 1 << 20; }
   
   static const size_t PageConst = 4096;
   size_t SamplePerInputFile() const { return MaxFileSize() / CompactSampleConst() / PageConst; }
@@ -166,10 +240,57 @@ struct SBSOptions : public SBSNodeOptions,
   //size_t sample_per_output_file_;
   bool force_pick_ = 1;
   bool ForcePick() const { return force_pick_; }
+  // Compact only a part of buffers holding more than MaxCompactionFiles().
+  bool partial_compaction_ = 1;
+  bool PartialCompaction() const { return partial_compaction_; }
+  // A level 1 pick takes alone a hole file overlapping no leaf and no other
+  // file of the buffer, which then moves down as a new leaf instead of 
+  // being rewritten with the buffer. Sorted bulk loads leave such files.
+  bool leaf_gap_moves_ = 0;
+  bool LeafGapMoves() const { return leaf_gap_moves_; }
+  // Put() and Pop() leave the splits and absorbs above the leaves to
+  // SBSkiplist::Rebalance(), so installing a file costs bounded work.
+  bool deferred_rebalance_ = 0;
+  bool DeferredRebalance() const { return deferred_rebalance_; }
+  // Keep node scores in a ScoreIndex and only rescore changed nodes,
+  // instead of scanning the whole tree on every pick.
+  bool incremental_score_ = 1;
+  bool IncrementalScore() const { return incremental_score_; }
+  // Keep a FileIndex, so files are located by number without scanning
+  // the buffers on their route.
+  bool index_files_ = 1;
+  bool IndexFiles() const { return index_files_; }
+  // Number of threads used to update all node tables before a pick.
+  size_t update_table_threads_ = 1;
+  size_t UpdateTableThreads() const { return update_table_threads_; }
+  // Trees with fewer leaves are updated serially, starting the workers 
+  // costs more than it saves there.
+  size_t parallel_update_min_leaves_ = 4096;
+  size_t ParallelUpdateMinLeaves() const { return parallel_update_min_leaves_; }
+  // Maximum number of workers a single compaction is split to.
+  size_t max_subcompactions_ = 1;
+  size_t MaxSubcompactions() const { return max_subcompactions_; }
+  // Which scorer NewScorer() returns, and the cost model it uses.
+  CostModel::Policy scorer_policy_ = CostModel::Balanced;
+  CostModel cost_model_;
+  CostModel::Policy ScorerPolicy() const { return scorer_policy_; }
+  void SetScorerPolicy(CostModel::Policy policy) {
+    scorer_policy_ = policy;
+    cost_model_ = CostModel::ForPolicy(policy);
+  }
+  // When a calibrator is installed, the constants of the cost model follow
+  // the observed I/O. It is shared by all copies of the options and
+  // must outlive them.
+  CostCalibrator* calibrator_ = nullptr;
+  virtual CostModel GetCostModel() const { 
+    return calibrator_ ? calibrator_->Calibrate(cost_model_) : cost_model_; 
+  }
 
  public:
   SBSOptions() = default;
   SBSOptions(const SBSOptions& options) = default;
 };
+static_assert(SBSOptions::kMaxHeight() <= SBSOptions::MaxTreeHeight, 
+              "the head must fit in a SBSNode");
 
 }
\ No newline at end of file
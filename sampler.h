@@ -1,47 +1,147 @@
 #pragma once
 
 #include <atomic>
+#include <array>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#include <cassert>
 
 #include "leveldb/slice.h"
 #include "../../db/memtable.h"
+#include "lockable.h"
 using leveldb::Slice;
 
 namespace sagitrs {
 
-struct SamplerTable : public std::map<std::string, int> {
-  public:
-  SamplerTable() : std::map<std::string, int>() {}
+// Keys are sampled into the map while sampling. StopSampling() freezes the
+// table into a read-only quantile index: all keys are packed into one
+// contiguous buffer in order with their prefix sums, so lookups are a
+// binary search that neither modifies the table nor allocates, and can be
+// run by concurrent readers.
+//
+// The table can be bounded to a number of entries. When it grows beyond
+// that, runs of adjacent entries are merged into their largest key as long
+// as a run weighs no more than 4/capacity of all samples, which halves the
+// table. Later samples inside a merged range are added to it, so ranges
+// never overlap. A merged range is only counted once the query reaches its
+// largest key, so GetCountSmallerOrEqualThan() undercounts by at most the
+// heaviest merged range, RankError() * TotalCount(). On a stable key
+// distribution that stays close to 4/capacity, whatever the key 
+// cardinality is.
+struct SamplerBucket {
+  size_t count_;
+  // smallest sampled key of a merged range.
+  std::string min_;
+  bool merged_;
+};
+struct SamplerTable : public std::map<std::string, SamplerBucket> {
+ private:
+  size_t capacity_;                // 0 means unbounded.
+  size_t total_;
+  size_t max_merged_;              // heaviest merged range, set when frozen.
+  bool frozen_;
+  std::string keys_;               // all keys, concatenated in order.
+  std::vector<size_t> offsets_;    // key i is keys_[offsets_[i], offsets_[i+1]).
+  std::vector<uint64_t> prefix_;   // first 8 bytes of key i, big-endian.
+  std::vector<size_t> counts_;     // total count of keys [0, i].
+
+  // Normalized key prefix, so most comparisons are a single integer compare.
+  static uint64_t NormalizedPrefix(const Slice& key) {
+    uint64_t res = 0;
+    for (size_t i = 0; i < 8; ++i)
+      res = (res << 8) | (i < key.size() ? (unsigned char)key[i] : 0);
+    return res;
+  }
+  Slice Key(size_t k) const { 
+    return Slice(keys_.data() + offsets_[k], offsets_[k + 1] - offsets_[k]); 
+  }
+ public:
+  SamplerTable(size_t capacity = 0) 
+  : std::map<std::string, SamplerBucket>(), capacity_(capacity), total_(0), 
+    max_merged_(0), frozen_(false) {}
+  void SetCapacity(size_t capacity) { capacity_ = capacity; }
+  // Maximum undercount of GetCountSmallerOrEqualThan(), relative to TotalCount().
+  double RankError() const { 
+    if (frozen_) return total_ == 0 ? 0 : 1.0 * max_merged_ / total_;
+    return capacity_ == 0 ? 0 : 4.0 / capacity_; 
+  }
   void Add(const Slice& key, size_t count = 1) {
+    assert(!frozen_);
     std::string skey(key.data(), key.size());
-    auto p = find(skey);
-    if (p != end())
-      p->second += count;
+    auto p = lower_bound(skey);
+    if (p != end() && (p->first == skey || (p->second.merged_ && p->second.min_ <= skey)))
+      p->second.count_ += count;
     else 
-      (*this)[skey] = count;
+      emplace_hint(p, skey, SamplerBucket{count, "", false});
+    total_ += count;
+    if (capacity_ > 0 && size() > capacity_)
+      Compact();
+  }
+  // Merged ranges of the given table are added at their largest key,
+  // so the rank errors of both tables add up.
+  void Merge(const SamplerTable& table) {
+    assert(!frozen_ && !table.frozen_);
+    for (auto& p : table)
+      Add(p.first, p.second.count_);
+  }
+  void Compact() {
+    size_t limit = 4 * total_ / capacity_ + 1;
+    for (auto iter = begin(); iter != end();) {
+      auto next = std::next(iter);
+      if (next == end()) break;
+      if (iter->second.count_ + next->second.count_ <= limit) {
+        SamplerBucket& bucket = next->second;
+        bucket.count_ += iter->second.count_;
+        bucket.min_ = iter->second.merged_ ? iter->second.min_ : iter->first;
+        bucket.merged_ = true;
+        iter = erase(iter);
+      } else {
+        iter = next;
+      }
+    }
   }
   void StopSampling() {
-    size_t total = 0;
+    size_t total = 0, bytes = 0;
+    for (auto iter = begin(); iter != end(); ++iter)
+      bytes += iter->first.size();
+    keys_.clear(); offsets_.clear(); prefix_.clear(); counts_.clear();
+    keys_.reserve(bytes);
+    offsets_.reserve(size() + 1);
+    prefix_.reserve(size());
+    counts_.reserve(size());
     for (auto iter = begin(); iter != end(); ++iter) {
-      total += iter->second;
-      iter->second = total;
+      total += iter->second.count_;
+      if (iter->second.merged_ && iter->second.count_ > max_merged_)
+        max_merged_ = iter->second.count_;
+      offsets_.push_back(keys_.size());
+      keys_.append(iter->first);
+      prefix_.push_back(NormalizedPrefix(iter->first));
+      counts_.push_back(total);
     }
+    offsets_.push_back(keys_.size());
+    clear();
+    frozen_ = true;
   }
-  size_t GetCountSmallerOrEqualThan(const Slice& key) {
-    std::string skey(key.data(), key.size());
-    auto p = find(skey);
-    if (p != end()) 
-      return p->second;
-
-    (*this)[skey] = 0;
-    p = find(skey);
-    assert(p != end());
-    if (p == begin())
-      return 0;
-    p--;
-    (*this)[skey] = p->second;
-    return p->second;
+  bool Frozen() const { return frozen_; }
+  size_t TotalCount() const { return total_; }
+  size_t GetCountSmallerOrEqualThan(const Slice& key) const {
+    assert(frozen_);
+    uint64_t prefix = NormalizedPrefix(key);
+    // find the first key greater than the given key.
+    size_t l = 0, r = counts_.size();
+    while (l < r) {
+      size_t mid = (l + r) / 2;
+      bool greater = prefix_[mid] != prefix ? 
+        prefix_[mid] > prefix : Key(mid).compare(key) > 0;
+      if (greater) 
+        r = mid;
+      else 
+        l = mid + 1;
+    }
+    return l == 0 ? 0 : counts_[l - 1];
   }
 };
 
@@ -49,32 +149,120 @@ struct Sampler {
  private:
   struct SamplerOptions {
     size_t sample_rate = 100;
+    // Memory budget of each table, in entries. 
+    size_t table_capacity = 1 << 16;
+  };
+  enum SampleType : uint8_t { ReadSampleType, WriteSampleType, IterateSampleType };
+  static const size_t ReservoirSize = 512;
+  static const size_t ReservoirCount = 16;
+  struct Record {
+    SampleType type_;
+    uint32_t bytes_;
+    // the key is keys_[offset_, offset_ + size_) of its reservoir.
+    uint32_t offset_;
+    uint32_t size_;
+  };
+  // Samples are appended to one of several fixed-size reservoirs picked by
+  // thread. A reservoir has its own lock, which threads only share when 
+  // they hash to the same reservoir, and full keys are copied into a buffer
+  // whose capacity is kept, so the insert path allocates only while that
+  // buffer grows to the longest keys seen. The writer that fills a 
+  // reservoir drains it into the tables under tables_mutex_, which 
+  // allocates their entries; reading the tables drains all reservoirs.
+  struct Reservoir : public Lockable {
+    size_t size_ = 0;
+    std::array<Record, ReservoirSize> records_;
+    std::string keys_;
+    Reservoir() { keys_.reserve(ReservoirSize * 32); }
   };
   
   SamplerOptions options_;
   SamplerTable read_sampler_, write_sampler_, write_bytes_sampler_, iterate_sampler_;
   std::atomic<uint64_t> last_install_;
+  std::array<Reservoir, ReservoirCount> reservoirs_;
+  std::mutex tables_mutex_;
   //std::atomic<uint64_t> memory_usage_, record_count_;
+
+  static size_t ThreadReservoir() {
+    static thread_local size_t id = 
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % ReservoirCount;
+    return id;
+  }
+  void Sample(SampleType type, const Slice& key, size_t bytes) {
+    Reservoir& r = reservoirs_[ThreadReservoir()];
+    LockGuard guard(&r, LockGuard::WriteLock);
+    if (r.size_ == ReservoirSize) 
+      Drain(r);
+    Record& record = r.records_[r.size_++];
+    record.type_ = type;
+    record.bytes_ = bytes;
+    record.offset_ = r.keys_.size();
+    record.size_ = key.size();
+    r.keys_.append(key.data(), key.size());
+  }
+  // Samples that arrive after StopSampling() are dropped.
+  static void AddUnfrozen(SamplerTable& table, const Slice& key, size_t count) {
+    if (!table.Frozen()) 
+      table.Add(key, count);
+  }
+  // Assert: r is locked.
+  void Drain(Reservoir& r) {
+    std::lock_guard<std::mutex> guard(tables_mutex_);
+    for (size_t i = 0; i < r.size_; ++i) {
+      const Record& record = r.records_[i];
+      Slice key(r.keys_.data() + record.offset_, record.size_);
+      switch (record.type_) {
+      case ReadSampleType: 
+        AddUnfrozen(read_sampler_, key, 1); 
+        break;
+      case WriteSampleType:
+        AddUnfrozen(write_sampler_, key, 1);
+        AddUnfrozen(write_bytes_sampler_, key, record.bytes_);
+        break;
+      case IterateSampleType: 
+        AddUnfrozen(iterate_sampler_, key, 1); 
+        break;
+      }
+    }
+    r.size_ = 0;
+    r.keys_.clear();
+  }
  public:
   Sampler() : 
     options_(),
-    write_sampler_(), read_sampler_(), write_bytes_sampler_(), iterate_sampler_(),
-    last_install_(0)
+    read_sampler_(), write_sampler_(), write_bytes_sampler_(), iterate_sampler_(),
+    last_install_(0),
+    reservoirs_(),
+    tables_mutex_()
     //memory_usage_(0), record_count_(0)
-  {}
+  {
+    for (auto table : {&read_sampler_, &write_sampler_, &write_bytes_sampler_, &iterate_sampler_})
+      table->SetCapacity(options_.table_capacity);
+  }
   ~Sampler() {}
   void WriteSample(const Slice& key, size_t value_size) {
-    write_sampler_.Add(key);
-    write_bytes_sampler_.Add(key, key.size() + value_size + 10);
-    //global_sampler_.Add(key);
-  }
-  void ReadSample(const Slice& key) { read_sampler_.Add(key); }
-  void IterateSample(const Slice& key) { iterate_sampler_.Add(key); }
-  SamplerTable& WriteTable() { return write_sampler_; }
-  SamplerTable& ReadTable() { return read_sampler_; }
-  SamplerTable& IterateTable() { return iterate_sampler_; }
-  SamplerTable& WriteBytesTable() { return write_bytes_sampler_; }
+    Sample(WriteSampleType, key, key.size() + value_size + 10);
+  }
+  void ReadSample(const Slice& key) { Sample(ReadSampleType, key, 0); }
+  void IterateSample(const Slice& key) { Sample(IterateSampleType, key, 0); }
+  // Move all buffered samples into the tables.
+  void Collect() {
+    for (auto& r : reservoirs_) {
+      LockGuard guard(&r, LockGuard::WriteLock);
+      Drain(r);
+    }
+  }
+  // The tables are only read after an install, which shall stop all
+  // samplers that write into this one.
+  SamplerTable& WriteTable() { Collect(); return write_sampler_; }
+  SamplerTable& ReadTable() { Collect(); return read_sampler_; }
+  SamplerTable& IterateTable() { Collect(); return iterate_sampler_; }
+  SamplerTable& WriteBytesTable() { Collect(); return write_bytes_sampler_; }
   std::atomic<uint64_t>& LastInstall() { return last_install_; }
+  void Install(uint64_t install) {
+    Collect();
+    last_install_.store(install, std::memory_order_release);
+  }
 };
 
 }
\ No newline at end of file
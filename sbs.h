@@ -2,12 +2,17 @@
 
 #include <vector>
 #include <stack>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <string>
 #include <algorithm>
 #include <math.h>
 #include "sbs_node.h"
 #include "sbs_iterator.h"
 #include "delineator.h"
 #include "sublist.h"
+#include "metrics.h"
 
 #include "scorer_impl.h"
 #include "sampler.h"
@@ -19,14 +24,31 @@ struct SBSkiplist {
   typedef SBSNode TypeNode;
   SBSOptions options_;
  private:
+  ScoreIndex* score_index_;
+  FileIndex* file_index_;
   SBSNode* head_;
+  // keys whose route holds a node out of its width range, see Rebalance().
+  std::deque<std::string> unbalanced_;
+  // files updated by UpdateStatistics() whose route is not marked dirty 
+  // yet, to the time slice of their last get (-1 if none).
+  std::unordered_map<uint64_t, int64_t> stale_;
  public:
   SBSkiplist(const SBSOptions& options) 
   : options_(options),
-    head_(new SBSNode(options_, options_.kMaxHeight())) {}
+    score_index_(options.IncrementalScore() ? new ScoreIndex() : nullptr),
+    file_index_(options.IndexFiles() ? new FileIndex() : nullptr),
+    head_(nullptr),
+    unbalanced_(),
+    stale_() {
+    options_.score_index_ = score_index_;
+    options_.file_index_ = file_index_;
+    head_ = new SBSNode(options_, options_.kMaxHeight());
+  }
   inline SBSIterator* NewIterator() const { return new SBSIterator(head_); }
   
   ~SBSkiplist() {
+    if (file_index_) 
+      file_index_->Close();
     std::vector<SBSNode*> list;
     for (SBSNode* node = head_; node != nullptr; node = node->Next(0))
       list.push_back(node);
@@ -34,124 +56,214 @@ struct SBSkiplist {
       node->ReleaseAll();
       delete node;
     }
+    delete score_index_;
+    delete file_index_;
   }
   void ReplaceHead(SBSNode* new_head) { head_ = new_head; }
   void Put(BFile* value) {
-    auto iter = NewIterator();
-    bool state = PutBlocked(value, iter);
+    SBSIterator iter(head_);
+    bool deferred = options_.DeferredRebalance();
+    bool state = PutBlocked(value, &iter, deferred);
+    if (deferred && !iter.RouteBalanced(options_))
+      unbalanced_.push_back(value->Min().ToString());
     if (!state) {
       BFileVec container;
-      assert(iter->Current().TestState(options_) > 0);
-      iter->Current().SplitNext(options_, &container);
+      assert(iter.Current().TestState(options_) > 0);
+      iter.SplitCurrent(options_, &container);
       for (auto &v : container) {
-        PutBlocked(v, iter);
+        PutBlocked(v, &iter);
       }
     }
-    delete iter;
   }
-  bool PutBlocked(BFile* value, SBSIterator* iter) {
+  bool PutBlocked(BFile* value, SBSIterator* iter, bool leaf_only = false) {
     iter->SeekToRoot();
-    bool state = iter->Add(options_, value);
+    bool state = iter->Add(options_, value, leaf_only);
     return state;
     //iter.TargetIncStatistics(value->Min(), DefaultCounterType::PutCount, 1);                          // Put Statistics.
   }
   
   int SeekHeight(const Bounded& range) {
-    auto iter = NewIterator();
-    iter->SeekToRoot();
-    iter->SeekRange(range, true);
-    int height = iter->Current().height_;
-    delete iter;
+    SBSIterator iter(head_);
+    iter.SeekToRoot();
+    iter.SeekRange(range, true);
+    int height = iter.Current().height_;
     return height;
   }
   inline void LookupKey(const Slice& key, BFileVec& container) const {
-    auto iter = NewIterator();
-    iter->SeekToRoot();
-    RealBounded bound(key, key);
-    iter->SeekRange(bound);
+    SBSIterator iter(head_);
+    iter.SeekToRoot();
+    SliceBounded bound(key, key);
+    iter.SeekRange(bound);
     //std::cout << iter.ToString() << std::endl;
-    iter->GetBufferOnRoute(container, key);
-    delete iter;
+    iter.GetBufferOnRoute(container, key);
   }
   SubSBS* LookupTree(const BFileEdit& edit) {//, std::vector<SBSNode*>& prev
-    auto iter = NewIterator();
+    ReleaseInstalled(edit);
+    SBSIterator iter(head_);
     bool found = false;
     Coordinates suspect(nullptr, 0);
-    for (auto file : edit.deleted_) {
-      RealBounded bound(file->smallest.user_key(),file->smallest.user_key());
-      iter->SeekToRoot();
-      iter->SeekRange(bound);
-      BFile* target = iter->SeekValueInRoute(file->number);
-      size_t height = iter->Current().height_;
+    std::vector<leveldb::FileMetaData*> files(edit.deleted_);
+    files.insert(files.end(), edit.moved_.begin(), edit.moved_.end());
+    for (auto file : files) {
+      SliceBounded bound(file->smallest.user_key(),file->smallest.user_key());
+      iter.SeekToRoot();
+      BFile* target = iter.SeekFile(bound, file->number, file_index_);
+      size_t height = iter.Current().height_;
       if (height == 0) { 
         if (!found) {
-          iter->Float(); 
-          suspect = iter->Current();
+          iter.Float(); 
+          suspect = iter.Current();
           found = 1;
         }
         assert(suspect.height_ == 1);
         break;
       }
       if (!found) {
-        suspect = iter->Current();
+        suspect = iter.Current();
         found = 1;
         continue;
       }
-      Coordinates current = iter->Current();
+      Coordinates current = iter.Current();
       if (suspect.height_ == current.height_) {
         if (suspect.node_ == current.node_)
           continue; // search for another node.
         // they have common parent.
-        iter->Float();
-        auto iter2 = NewIterator();
-        iter2->SeekNode(suspect);
-        iter2->Float();
-        assert(iter->Current() == iter2->Current());
-        suspect = iter->Current();
-        delete iter2;
+        iter.Float();
+        SBSIterator iter2(head_);
+        iter2.SeekNode(suspect);
+        iter2.Float();
+        assert(iter.Current() == iter2.Current());
+        suspect = iter.Current();
         break;
       } else {
         if (suspect.height_ < current.height_) {
           Coordinates mid = current; 
           current = suspect;
           suspect = mid;
-          iter->SeekNode(current);
+          iter.SeekNode(current);
         }
         //suspect shall be current's parent.
-        iter->Float();
-        assert(iter->Current() == suspect);
+        iter.Float();
+        assert(iter.Current() == suspect);
         break;
       }
     }
-    iter->SeekNode(suspect);
-    iter->Prev();
-    SBSNode* prev = iter->Current().node_;
-    delete iter;
-    return new SubSBS(suspect.node_, suspect.height_, prev);
+    iter.SeekNode(suspect);
+    size_t depth = iter.Stack().Size();
+    SBSNode* parent = depth > 1 ? iter.Stack()[depth - 2].node_ : nullptr;
+    iter.Prev();
+    SBSNode* prev = iter.Current().node_;
+    return new SubSBS(suspect.node_, suspect.height_, prev, parent);
   }
+  // With indexed files, the file is found without descending and its 
+  // route is marked dirty later, see FlushStatistics().
   void UpdateStatistics(const BFile& file, uint32_t label, int64_t diff, int64_t time) {
-    auto iter = NewIterator();
-    iter->SeekToRoot();
-    iter->SeekRange(file);
-    auto target = iter->SeekValueInRoute(file.Identifier());
-    if (target == nullptr) {
+    if (file_index_) {
+      FileIndex::Entry entry;
       // file is deleted when bversion is unlocked.
+      if (!file_index_->Find(file.Identifier(), entry))
+        return;
+      entry.file_->UpdateStatistics(label, diff, time);
+      auto p = stale_.emplace(file.Identifier(), -1).first;
+      if (label == KSGetCount)
+        p->second = std::max(p->second, time);
+      return;
+    }
+    SBSIterator iter(head_);
+    iter.SeekToRoot();
+    auto target = iter.SeekFile(file, file.Identifier(), file_index_);
+    if (target == nullptr) {
       return;
     }
     //Statistics::TypeTime now = options_->NowTimeSlice();
     target->UpdateStatistics(label, diff, time);
-    iter->SetRouteStatisticsDirty();
-    //iter->UpdateRouteHottest(target);
-    delete iter;
+    iter.SetRouteStatisticsDirty();
+    if (label == KSGetCount)
+      iter.UpdateRouteHottest(target, time);
+  }
+  // Mark the routes of the files UpdateStatistics() changed dirty and 
+  // offer their gets to the hot ranges, once per file however often it was
+  // updated. Tables and scores read the routes, call it before.
+  void FlushStatistics() {
+    for (auto& p : stale_) {
+      FileIndex::Entry entry;
+      if (!file_index_->Find(p.first, entry))
+        continue;
+      SBSIterator iter(head_);
+      iter.SeekToRoot();
+      BFile* target = iter.SeekFile(*entry.file_, p.first, file_index_);
+      if (target == nullptr) 
+        continue;
+      iter.SetRouteStatisticsDirty();
+      if (p.second >= 0)
+        iter.UpdateRouteHottest(target, p.second);
+    }
+    stale_.clear();
+  }
+  // Locate a file by number without descending, false if it is not in 
+  // the tree or files are not indexed.
+  bool LocateFile(uint64_t id, FileIndex::Entry& entry) const {
+    return file_index_ && file_index_->Find(id, entry);
   }
   BFile* Pop(const BFile& file, bool auto_reinsert = true) {
-    auto iter = NewIterator();
-    iter->SeekToRoot();
+    SBSIterator iter(head_);
+    iter.SeekToRoot();
     //auto target = std::dynamic_pointer_cast<BoundedValue>(value);
-    auto res = iter->Del(options_, file, auto_reinsert);
-    delete iter;
+    bool deferred = options_.DeferredRebalance();
+    auto res = iter.Del(options_, file, auto_reinsert, deferred);
+    if (deferred) 
+      MarkUnbalanced(file.Min());
     return res;
   }
+  // Pop a set of files in one sweep, absorbing each node and reinserting
+  // displaced files once for the whole set. Deleted files are appended.
+  void PopBatch(const std::vector<BFile*>& files, std::vector<BFile*>& deleted) {
+    SBSIterator iter(head_);
+    bool deferred = options_.DeferredRebalance();
+    iter.DelBatch(options_, files, deleted, deferred);
+    if (deferred) 
+      for (BFile* file : files)
+        MarkUnbalanced(file->Min());
+  }
+  // Queue the route to key for Rebalance() if a node on it is out of range.
+  void MarkUnbalanced(const Slice& key) {
+    SBSIterator iter(head_);
+    SliceBounded bound(key, key);
+    iter.SeekRange(bound);
+    if (!iter.RouteBalanced(options_))
+      unbalanced_.push_back(key.ToString());
+  }
+  // With options.DeferredRebalance(), Put() and Pop() only split and absorb
+  // leaves and queue the routes left out of range. Rebalance the first
+  // max_routes of them, deepest node first, and return how many are left.
+  // Each route costs at most a few splits or absorbs per height.
+  size_t Rebalance(size_t max_routes) {
+    for (; max_routes > 0 && !unbalanced_.empty(); --max_routes) {
+      std::string key = unbalanced_.front();
+      unbalanced_.pop_front();
+      SBSIterator iter(head_);
+      SliceBounded bound(key, key);
+      iter.SeekRange(bound);
+      if (!iter.SplitRoute(options_)) {
+        // a file straddles the split point, put it again as Put() does, 
+        // splits above the leaves wait for a later route.
+        BFileVec container;
+        iter.SplitCurrent(options_, &container);
+        for (auto &v : container) {
+          PutBlocked(v, &iter, true);
+          if (!iter.RouteBalanced(options_))
+            unbalanced_.push_back(v->Min().ToString());
+        }
+      }
+      iter.SeekRange(bound);
+      iter.CheckAbsorb(options_);
+      iter.Reinsert(options_);
+      // absorbing may leave a node too wide, try again later.
+      MarkUnbalanced(key);
+    }
+    return unbalanced_.size();
+  }
+  size_t UnbalancedRoutes() const { return unbalanced_.size(); }
   void PickCompactionFilesByIterator(const sagitrs::SBSOptions& options,
                                      SBSIterator* iter, BFileVec* containers) {
     if (containers == nullptr) return;
@@ -162,6 +274,13 @@ struct SBSkiplist {
     BFileVec& l0guards = containers[3];
     // get file in current.
     iter->GetBufferInCurrent(base_buffer);
+    BFile* gap = options.LeafGapMoves() && iter->Current().height_ == 1 ? 
+                 PickLeafGap(iter->Current(), base_buffer) : nullptr;
+    if (gap != nullptr) {
+      base_buffer.clear();
+      base_buffer.Add(gap);
+    } else if (options.PartialCompaction() && base_buffer.size() > options.MaxCompactionFiles())
+      PickPartialBuffer(options, iter->Current(), base_buffer);
     // if last level, pick files into this compaction, otherwise push to guards.
     int height = iter->Current().height_;
     
@@ -198,6 +317,129 @@ struct SBSkiplist {
       Filter(guards, base_buffer);
     }
   }
+  // A compaction whose only input is a hole file overlapping no child can
+  // move the file down a height instead of rewriting it: in level 1 it
+  // becomes a new leaf (see PickLeafGap()), otherwise it must fit in one
+  // child, where TreePut() puts it. Record the file with BFileEdit::Move()
+  // then.
+  bool IsTrivialMove(const Coordinates& coord, const BFileVec* containers) const {
+    if (containers[0].size() != 1 || containers[1].size() != 0) 
+      return false;
+    BFile* file = containers[0].GetOne();
+    if (file->Type() != BFile::TypeHole) 
+      return false;
+    size_t height = coord.height_;
+    if (height == 1) 
+      return FitsLeafGap(coord, *file);
+    if (file->Data()->file_size < coord.node_->GetLevel(height)->table_[MinHoleFileSize])
+      return false;
+    SBSNode* ed = coord.Next();
+    for (SBSNode* n = coord.node_; n != ed; ) {
+      SBSNode* next = n->Next(height - 1);
+      if (next == nullptr || file->Max().compare(next->Guard()) < 0)
+        return true;
+      if (file->Min().compare(next->Guard()) < 0)
+        return false;
+      n = next;
+    }
+    return false;
+  }
+  // Whether file, in level 1 of coord, overlaps no leaf there and can be
+  // linked after the leaf of coord.node_. Only the head may have no leaf.
+  bool FitsLeafGap(const Coordinates& coord, const BFile& file) const {
+    auto& leaf = coord.node_->GetLevel(0)->buffer_;
+    if (!leaf.empty() && leaf.Compare(file) != BLess)
+      return false;
+    SBSNode* ed = coord.Next();
+    for (SBSNode* n = coord.node_->Next(0); n != ed; n = n->Next(0)) {
+      auto& next = n->GetLevel(0)->buffer_;
+      if (!next.empty() && next.Compare(file) == BOverlap)
+        return false;
+    }
+    return true;
+  }
+  // A hole file of a level 1 buffer overlapping no leaf and no other file
+  // of the buffer, compacted alone it is a trivial move. See LeafGapMoves().
+  BFile* PickLeafGap(const Coordinates& coord, const BFileVec& buffer) const {
+    for (BFile* file : buffer) {
+      if (file->Type() != BFile::TypeHole || !FitsLeafGap(coord, *file)) 
+        continue;
+      bool alone = true;
+      for (BFile* other : buffer)
+        if (other != file && other->Compare(*file) == BOverlap)
+          alone = false;
+      if (alone) return file;
+    }
+    return nullptr;
+  }
+  // Keep the files of buffer that are worth compacting first, at most
+  // MaxCompactionFiles() if possible. In Min order, the buffer falls into
+  // groups of overlapping files; a choice is a run of consecutive groups,
+  // so no file left behind overlaps the compaction. The run removing most
+  // child runs (GetValueWidth) per byte rewritten is chosen, among those
+  // of at least half the limit if there are such. In level 1 the bytes of
+  // a group include the leaves it overlaps, which are rewritten with it.
+  void PickPartialBuffer(const sagitrs::SBSOptions& options, 
+                         const Coordinates& coord, BFileVec& buffer) {
+    // BFileVec is kept sorted by Min.
+    std::vector<BFile*> files(buffer.begin(), buffer.end());
+    BFileVec children;
+    coord.node_->GetChildGuard(coord.height_, &children);
+    // groups_[i] is the first file of group i.
+    std::vector<size_t> groups;
+    std::vector<double> runs, bytes;
+    std::vector<RealBounded> ranges;
+    Slice max;
+    for (size_t i = 0; i < files.size(); ++i) {
+      BFile* file = files[i];
+      if (i == 0 || file->Min().compare(max) > 0) {
+        groups.push_back(i);
+        runs.push_back(0);
+        bytes.push_back(0);
+        ranges.emplace_back(file->Min(), file->Max());
+      }
+      if (i == 0 || file->Max().compare(max) > 0) 
+        max = file->Max();
+      ranges.back().Extend(*file);
+      if (file->Type() == BFile::TypeHole)
+        runs.back() += children.GetValueWidth(*file);
+      bytes.back() += file->Data()->file_size;
+    }
+    groups.push_back(files.size());
+    if (coord.height_ == 1)
+      for (SBSNode* n = coord.node_; n != coord.Next(); n = n->Next(0)) {
+        BFile* leaf = n->GetLevel(0)->buffer_.GetOne();
+        if (leaf == nullptr) continue;
+        for (size_t g = 0; g < ranges.size(); ++g)
+          if (leaf->Compare(ranges[g]) == BOverlap)
+            bytes[g] += leaf->Data()->file_size;
+      }
+    size_t limit = options.MaxCompactionFiles();
+    size_t best_st = 0, best_ed = groups.size() - 1;
+    bool best_large = false;
+    double best_ratio = -1;
+    for (size_t st = 0; st + 1 < groups.size(); ++st) {
+      double r = 0, b = 0;
+      for (size_t ed = st + 1; ed < groups.size(); ++ed) {
+        size_t count = groups[ed] - groups[st];
+        if (count > limit && ed > st + 1) break;
+        r += runs[ed - 1]; 
+        b += bytes[ed - 1];
+        bool large = count * 2 >= limit;
+        double ratio = b > 0 ? r / b : 0;
+        if (large > best_large || (large == best_large && ratio > best_ratio) ||
+            (large == best_large && ratio == best_ratio && count > groups[best_ed] - groups[best_st])) {
+          best_large = large;
+          best_ratio = ratio;
+          best_st = st;
+          best_ed = ed;
+        }
+      }
+    }
+    buffer.clear();
+    for (size_t i = groups[best_st]; i < groups[best_ed]; ++i)
+      buffer.Add(files[i]);
+  }
   void Filter(BFileVec& vec, const Bounded& range) {
     BFileVec result;
     for (BFile* file : vec) 
@@ -218,8 +460,10 @@ struct SBSkiplist {
       : coord_(coord), guard_file_(file), sample_covers_(size),
         picked_(false) {}
   };
+  // Samples are counted only once the table is frozen, see StopSampling().
   void PickShard(std::vector<Shard>& shards, sagitrs::Coordinates parent, 
                  SamplerTable* table) {
+    if (table && !table->Frozen()) table = nullptr;
     auto st = parent; st.JumpDown();
     auto ed = parent; ed.JumpNext(); ed.JumpDown();
     size_t prev = 0;
@@ -246,10 +490,9 @@ struct SBSkiplist {
       //auto& l0buffer = ed.node_->GetLevel(0)->buffer_;
       //last_file = l0buffer.at(0);
     } else {
-      auto iter = NewIterator();
-      iter->SeekToLast(0);
-      last_file = iter->Current().Buffer().GetOne();
-      delete iter;
+      SBSIterator iter(head_);
+      iter.SeekToLast(0);
+      last_file = iter.Current().Buffer().GetOne();
     }
     {
       Slice min_key(last_file->Min());
@@ -288,11 +531,125 @@ struct SBSkiplist {
     }
     return guard_picked;
   }
+
+  // A compaction at parent can be merged by several workers in parallel:
+  // its key range is cut at some of the picked guards into subcompactions 
+  // that cover roughly the same number of samples. A subcompaction covers
+  // [begin_->Min(), end_->Min()), nullptr means unbounded, and splits its
+  // outputs at guards_. Outputs of all workers go to one BFileEdit, see 
+  // BFileEdit::Merge().
+  struct Subcompaction {
+    BFile* begin_;
+    BFile* end_;
+    size_t sample_covers_;
+    BFileVec guards_;
+    Subcompaction(BFile* begin) 
+    : begin_(begin), end_(nullptr), sample_covers_(0), guards_() {}
+    bool Contains(const Slice& key) const {
+      return (begin_ == nullptr || key.compare(begin_->Min()) >= 0) &&
+             (end_ == nullptr || key.compare(end_->Min()) < 0);
+    }
+  };
+  void PlanSubcompactions(const sagitrs::SBSOptions& options, 
+                          sagitrs::Coordinates parent, const BFileVec& guards,
+                          std::vector<Subcompaction>& plan) {
+    plan.clear();
+    plan.emplace_back(nullptr);
+    std::vector<Shard> shards;
+    PickShard(shards, parent, options.table_);
+    size_t max_plan = options.MaxSubcompactions();
+    if (max_plan <= 1 || shards.size() <= 1 || guards.size() == 0) {
+      plan.back().guards_.AddAll(guards);
+      return;
+    }
+    // without samples, every child is taken as the same size.
+    size_t total = 0;
+    for (auto& shard : shards) total += shard.sample_covers_;
+    bool sampled = total > 0;
+    if (!sampled) total = shards.size();
+    size_t target = (total + max_plan - 1) / max_plan;
+
+    std::set<BFile*> picked(guards.begin(), guards.end());
+    for (size_t i = 0; i < shards.size(); ++i) {
+      Shard& shard = shards[i];
+      bool cut = i > 0 && plan.size() < max_plan && 
+                 plan.back().sample_covers_ >= target &&
+                 picked.count(shard.guard_file_);
+      if (cut) {
+        plan.back().end_ = shard.guard_file_;
+        plan.emplace_back(shard.guard_file_);
+      }
+      plan.back().sample_covers_ += sampled ? shard.sample_covers_ : 1;
+    }
+    for (BFile* guard : guards)
+      for (auto& sub : plan)
+        if (sub.Contains(guard->Min()) && guard != sub.begin_) {
+          sub.guards_.push_back(guard);
+          break;
+        }
+  }
   
+  // Rescore the level nodes changed since last pick. All nodes are
+  // rescored when a new time slice begins.
+  void RefreshScoreIndex(Scorer& scorer) {
+    FlushStatistics();
+    auto now = options_.NowTimeSlice();
+    auto& dirty = score_index_->dirty_;
+    SBSIterator iter(head_);
+    if (score_index_->time_ != (int64_t)now) {
+      iter.UpdateAllTable(options_.UpdateTableThreads());
+      for (auto node = head_; node != nullptr; node = node->Next(0))
+        for (size_t h = 1; h < node->Height(); ++h)
+          score_index_->SetDirty(node->GetLevel(h));
+      score_index_->time_ = now;
+    } else {
+      const LevelNode::VariableTable& gtable = iter.Current().Table();
+      // the global table first, others depend on it.
+      LevelNode* root = head_->GetLevel(head_->Height() - 1);
+      if (dirty.find(root) != dirty.end())
+        iter.UpdateTableAt(Coordinates(head_, head_->Height() - 1), now, &gtable);
+      for (LevelNode* lnode : dirty)
+        if (lnode != root && InTree(lnode))
+          iter.UpdateTableAt(Coordinates(lnode->owner_, lnode->height_), now, &gtable);
+    }
+    for (LevelNode* lnode : dirty) {
+      bool pickable = InTree(lnode) && lnode->height_ > 0 && lnode->buffer_.size() > 0;
+      score_index_->Update(lnode, pickable ? scorer.GetScore(lnode->owner_, lnode->height_) : -1);
+    }
+    dirty.clear();
+  }
+  // Level nodes swapped out of the tree are dropped from the index by 
+  // SBSNode::SetLevel(), check it anyway before one is picked.
+  static bool InTree(LevelNode* lnode) {
+    SBSNode* node = lnode->owner_;
+    return node && lnode->height_ < node->Height() && node->GetLevel(lnode->height_) == lnode;
+  }
+  SBSIterator* NewIndexedScoreIterator(Scorer& scorer, double baseline, double& score) {
+    RefreshScoreIndex(scorer);
+    scorer.Reset(baseline);
+    LevelNode* best = nullptr;
+    for (auto p = score_index_->heap_.rbegin(); p != score_index_->heap_.rend(); ++p)
+      if (!p->second->reserved_ && InTree(p->second)) {
+        best = p->second;
+        scorer.Update(best->owner_, best->height_);
+        break;
+      }
+    score = scorer.MaxScore();
+    if (!scorer.isUpdated()) 
+      return nullptr;
+    SBSIterator* iter = NewIterator();
+    iter->SeekNode(Coordinates(best->owner_, best->height_));
+    return iter;
+  }
+  // Caller owns the result.
+  Scorer* NewScorer() const { return sagitrs::NewScorer(head_, options_.ScorerPolicy()); }
   SBSIterator* NewScoreIterator(Scorer& scorer, double baseline, double& score) {
+    if (score_index_)
+      return NewIndexedScoreIterator(scorer, baseline, score);
+    FlushStatistics();
     SBSIterator* iter = NewIterator();
     iter->SeekToRoot();
-    iter->UpdateAllTable();
+    iter->UpdateAllTable(options_.UpdateTableThreads());
     score = iter->SeekScore(scorer, baseline, baseline != 0);
     if (scorer.isUpdated()) {
       return iter;
@@ -301,7 +658,149 @@ struct SBSkiplist {
       return nullptr;
     }
   }
+  //--------------------------concurrent compactions-------------------------
+  // A compaction picked at (node, height) rewrites files in that subtree
+  // only, so compactions whose subtrees are disjoint can run together.
+  // The subtree is kept as a key range, its level nodes may be replaced,
+  // split or absorbed before the compaction is installed.
+  struct Region {
+    std::string guard_, limit_;
+    // no limit, the region reaches the end of the key space.
+    bool last_;
+    size_t height_;
+    // numbers of the reserved input files.
+    std::vector<uint64_t> files_;
+    Region(const Coordinates& coord) 
+    : guard_(coord.node_->Guard().ToString()), limit_(), 
+      last_(coord.Next() == nullptr), height_(coord.height_), files_() {
+      if (!last_) limit_ = coord.Next()->Guard().ToString();
+    }
+    // Subtrees are nested or disjoint, so key ranges overlap only if 
+    // one of them contains the other.
+    bool Overlap(const Region& r) const {
+      return (last_ || Slice(r.guard_).compare(limit_) < 0) &&
+             (r.last_ || Slice(guard_).compare(r.limit_) < 0);
+    }
+    bool Contains(uint64_t id) const {
+      return std::find(files_.begin(), files_.end(), id) != files_.end();
+    }
+  };
+  struct CompactionJob {
+    Coordinates coord_;
+    Region region_;
+    double score_;
+    // same layout as PickCompactionFilesByIterator().
+    BFileVec containers_[4];
+    CompactionJob(const Coordinates& coord, double score) 
+    : coord_(coord), region_(coord), score_(score) {}
+  };
+  bool Reserved(const Coordinates& coord) const {
+    Region region(coord);
+    for (auto& r : reserved_) 
+      if (r.Overlap(region)) 
+        return 1;
+    return 0;
+  }
+  // Pick up to k compactions with score above baseline, in descending
+  // score, whose subtrees do not overlap each other nor any compaction 
+  // still running. Their nodes and input files are reserved until the 
+  // compaction is installed through LookupTree() or released.
+  size_t PickCompactions(Scorer& scorer, double baseline, size_t k, 
+                         std::vector<CompactionJob*>& jobs) {
+    std::vector<std::pair<double, Coordinates>> candidates;
+    if (score_index_) {
+      RefreshScoreIndex(scorer);
+      for (auto p = score_index_->heap_.rbegin(); p != score_index_->heap_.rend(); ++p) {
+        if (p->first <= baseline) break;
+        if (!InTree(p->second)) continue;
+        candidates.emplace_back(p->first, Coordinates(p->second->owner_, p->second->height_));
+      }
+    } else {
+      FlushStatistics();
+      SBSIterator iter(head_);
+      iter.UpdateAllTable(options_.UpdateTableThreads());
+      for (auto node = head_; node != nullptr; node = node->Next(0))
+        for (size_t h = 1; h < node->Height(); ++h) 
+          if (node->GetLevel(h)->buffer_.size() > 0) {
+            double score = scorer.GetScore(node, h);
+            if (score > baseline)
+              candidates.emplace_back(score, Coordinates(node, h));
+          }
+      std::sort(candidates.begin(), candidates.end(), 
+        [](const std::pair<double, Coordinates>& a, const std::pair<double, Coordinates>& b) {
+          return a.first > b.first; });
+    }
+    size_t picked = 0;
+    for (auto& c : candidates) {
+      if (picked >= k) break;
+      if (Reserved(c.second)) continue;
+      auto job = new CompactionJob(c.second, c.first);
+      SBSIterator iter(head_);
+      iter.SeekNode(c.second);
+      PickCompactionFilesByIterator(options_, &iter, job->containers_);
+      Reserve(*job);
+      jobs.push_back(job);
+      picked ++;
+    }
+    return picked;
+  }
+  // Release a job that will not be installed.
+  void ReleaseCompaction(CompactionJob* job) {
+    for (size_t i = 0; i < 2; ++i)
+      for (BFile* file : job->containers_[i])
+        MarkFile(file, false);
+    // the level node now holding the start of the region.
+    SBSIterator iter(head_);
+    SliceBounded bound(job->region_.guard_, job->region_.guard_);
+    iter.SeekRange(bound);
+    for (size_t i = 0; i < iter.Stack().Size(); ++i) {
+      const Coordinates& c = iter.Stack()[i];
+      if (c.height_ == job->region_.height_) {
+        c.node_->GetLevel(c.height_)->reserved_ = false;
+        c.node_->GetLevel(c.height_)->SetDirty();
+      }
+    }
+    for (auto r = reserved_.begin(); r != reserved_.end(); ++r)
+      if (r->guard_ == job->region_.guard_ && r->height_ == job->region_.height_) {
+        reserved_.erase(r);
+        break;
+      }
+  }
  private:
+  std::vector<Region> reserved_;
+  void MarkFile(BFile* file, bool reserve) {
+    file->SetReserved(reserve);
+    // rescore, reserved files are not counted.
+    FileIndex::Entry entry;
+    if (LocateFile(file->Identifier(), entry))
+      entry.node_->GetLevel(entry.height_)->SetDirty();
+  }
+  void Reserve(CompactionJob& job) {
+    LevelNode* lnode = job.coord_.node_->GetLevel(job.coord_.height_);
+    lnode->reserved_ = true;
+    // rescore, reserved nodes score 0.
+    lnode->SetDirty();
+    for (size_t i = 0; i < 2; ++i)
+      for (BFile* file : job.containers_[i]) {
+        MarkFile(file, true);
+        job.region_.files_.push_back(file->Identifier());
+      }
+    reserved_.push_back(job.region_);
+  }
+  // An edit being installed finishes the compactions of its inputs.
+  void ReleaseInstalled(const BFileEdit& edit) {
+    for (auto r = reserved_.begin(); r != reserved_.end(); ) {
+      bool installed = false;
+      for (auto file : edit.deleted_)
+        installed = installed || r->Contains(file->number);
+      for (auto file : edit.moved_)
+        installed = installed || r->Contains(file->number);
+      if (installed)
+        r = reserved_.erase(r);
+      else 
+        ++r;
+    }
+  }
   void PrintDetailed(std::ostream& os) const {
     os << "----------Print Detailed Begin----------" << std::endl;
     head_->ForceUpdateStatistics();
@@ -327,21 +826,21 @@ struct SBSkiplist {
         }
       }
     };
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     std::vector<std::vector<NodeStatus>> map;
     size_t maxh = 0;
     os << "----------Print List Begin----------" << std::endl;
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      auto node = iter->Current().node_;
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      auto node = iter.Current().node_;
       auto height = node->Height();
       map.emplace_back();
       std::vector<NodeStatus>& lns = *map.rbegin();
       for (int h = 0; h < height; h ++) {
         lns.emplace_back(); NodeStatus& status = *lns.rbegin();//NodeStatus status;
-        //iter->SeekNode(c);
+        //iter.SeekNode(c);
         BFileVec children;
         node->GetChildGuard(h, &children);
-        //iter->GetChildGuardInCurrent(children);
+        //iter.GetChildGuardInCurrent(children);
         auto& buffer = node->GetLevel(h)->buffer_;
         for (auto value : buffer) {
           NodeStatus::ValueStatus vs;
@@ -353,7 +852,7 @@ struct SBSkiplist {
         buffer.GetStringSnapshot(status.ns_);
         status.width_ = children.size();
         //lns.push_back(status);
-        //iter->SeekNode(Coordinates(node, 0));
+        //iter.SeekNode(Coordinates(node, 0));
       }
       if (height > maxh) maxh = height;
     }
@@ -397,16 +896,15 @@ struct SBSkiplist {
       }
     }
     os << "----------Print List End----------" << std::endl;
-    delete iter;
   }
  
   void OldPrintSimple(std::ostream& os) const {
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     std::vector<size_t> hs;
     size_t maxh = 0;
     os << "----------Print Simple Begin----------" << std::endl;
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      auto height = iter->Current().node_->Height();
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      auto height = iter.Current().node_->Height();
       hs.push_back(height);
       if (height > maxh) maxh = height;
     }
@@ -416,18 +914,17 @@ struct SBSkiplist {
       os << std::endl;
     }
     os << "----------Print Simple End----------" << std::endl;
-    delete iter;
   }
   void PrintSimple(std::ostream& os) const {
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     std::vector<std::vector<size_t>> map;
     size_t maxh = 0;
     os << "----------Print Hole Begin----------" << std::endl;
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      auto height = iter->Current().node_->Height();
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      auto height = iter.Current().node_->Height();
       std::vector<size_t> height_state;
       for (size_t i = 0; i < height; ++i)
-        height_state.push_back(iter->Current().node_->GetLevel(i)->buffer_.HoleSize());
+        height_state.push_back(iter.Current().node_->GetLevel(i)->buffer_.HoleSize());
       map.push_back(height_state);
       if (height > maxh) maxh = height;
     }
@@ -443,18 +940,17 @@ struct SBSkiplist {
       os << std::endl;
     }
     os << "----------Print Hole End----------" << std::endl;
-    delete iter;
   }
   void PrintCapacitySimple(std::ostream& os) const {
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     std::vector<std::vector<size_t>> map;
     size_t maxh = 0;
     os << "---------- Print Max Run ----------" << std::endl;
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      auto height = iter->Current().node_->Height();
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      auto height = iter.Current().node_->Height();
       std::vector<size_t> height_state;
       for (size_t i = 0; i < height; ++i) {
-        size_t max_runs = 0.01 * iter->Current().node_->GetLevel(i)->table_[HoleFileCapacity];
+        size_t max_runs = 0.01 * iter.Current().node_->GetLevel(i)->table_[HoleFileCapacity];
         //assert(max_runs >= 0);
         if (max_runs > options_.MaxWidth() * options_.DefaultWidth()) {
           std::cout << "Error : Invalid Max Runs." << std::endl;
@@ -478,26 +974,25 @@ struct SBSkiplist {
       os << std::endl;
     }
     os << "----------Print Tape File End----------" << std::endl;
-    delete iter;
   }
   void PrintWriteReadSimple(std::ostream& os) const {
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     std::vector<std::vector<size_t>> map;
     size_t maxh = 0;
     os << "-------- Print Write-Read Rate --------" << std::endl;
     double time = options_.TimeSliceMicroSecond() / 1000 / 1000;
     int64_t now = options_.NowTimeSlice();
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      auto height = iter->Current().node_->Height();
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      auto height = iter.Current().node_->Height();
       std::vector<size_t> height_state;
       for (size_t i = 0; i < height; ++i) {
         uint64_t read = 0, write = 0;
         if (i > 0) {
-          read = iter->Current().node_->GetLevel(i)->table_[LocalGet];
-          write = iter->Current().node_->GetLevel(i)->table_[LocalWrite];
+          read = iter.Current().node_->GetLevel(i)->table_[LocalGet];
+          write = iter.Current().node_->GetLevel(i)->table_[LocalWrite];
         }
         else {
-          SBSNode* node = iter->Current().node_;
+          SBSNode* node = iter.Current().node_;
           const Statistics* stats = node->GetTreeStatistics(i);
           if (stats) { 
             read = stats->GetStatistics(KSGetCount, now - 1) / time;
@@ -522,26 +1017,25 @@ struct SBSkiplist {
       os << std::endl;
     }
     os << "----------Print Tape File End----------" << std::endl;
-    delete iter;
   }
   void PrintHotSimple(std::ostream& os) const {
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     std::vector<std::vector<size_t>> map;
     size_t maxh = 0;
     os << "-------- Print Hot Rate --------" << std::endl;
     double time = options_.TimeSliceMicroSecond() / 1000 / 1000;
     int64_t now = options_.NowTimeSlice();
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      auto height = iter->Current().node_->Height();
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      auto height = iter.Current().node_->Height();
       std::vector<size_t> height_state;
       for (size_t i = 0; i < height; ++i) {
         uint64_t read = 0, write = 0;
         if (i > 0) {
-          read = iter->Current().node_->GetLevel(i)->table_[LocalGet];
-          write = iter->Current().node_->GetLevel(i)->table_[LocalWrite];
+          read = iter.Current().node_->GetLevel(i)->table_[LocalGet];
+          write = iter.Current().node_->GetLevel(i)->table_[LocalWrite];
         }
         else {
-          SBSNode* node = iter->Current().node_;
+          SBSNode* node = iter.Current().node_;
           const Statistics* stats = node->GetTreeStatistics(i);
           if (stats) { 
             read = stats->GetStatistics(KSGetCount, now - 1) / time;
@@ -567,18 +1061,17 @@ struct SBSkiplist {
       os << std::endl;
     }
     os << "----------Print Tape File End----------" << std::endl;
-    delete iter;
   }
   void PrintSmallFileSimple(std::ostream& os) const {
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     std::vector<std::vector<size_t>> map;
     size_t maxh = 0;
     os << "----------Print Tape File----------" << std::endl;
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      auto height = iter->Current().node_->Height();
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      auto height = iter.Current().node_->Height();
       std::vector<size_t> height_state;
       for (size_t i = 0; i < height; ++i)
-        height_state.push_back(iter->Current().node_->GetLevel(i)->buffer_.TapeSize());
+        height_state.push_back(iter.Current().node_->GetLevel(i)->buffer_.TapeSize());
       map.push_back(height_state);
       if (height > maxh) maxh = height;
     }
@@ -594,19 +1087,18 @@ struct SBSkiplist {
       os << std::endl;
     }
     os << "----------Print Tape File End----------" << std::endl;
-    delete iter;
   }
   void PrintStatistics(std::ostream& os) const {
     os << "----------Print Statistics Begin----------" << std::endl;
     Delineator d;
-    auto iter = NewIterator();
+    SBSIterator iter(head_);
     // return merged statistics.
-    //for (iter->SeekToFirst(0); iter->Valid(); iter->Next())
-    //  d.AddStatistics(iter->Current().node_->Guard(), iter->GetRouteMergedStatistics());
+    //for (iter.SeekToFirst(0); iter.Valid(); iter.Next())
+    //  d.AddStatistics(iter.Current().node_->Guard(), iter.GetRouteMergedStatistics());
     // return only last level statistics.
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next())
-      if (iter->Current().Buffer().size() == 1)
-        d.AddStatistics(iter->Current().node_->Guard(), *iter->Current().Buffer().GetStatistics());
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next())
+      if (iter.Current().Buffer().size() == 1)
+        d.AddStatistics(iter.Current().node_->Guard(), *iter.Current().Buffer().GetStatistics());
     auto now = options_.NowTimeSlice();
     os << "----------Print KSGet----------" << std::endl;
     d.PrintTo(os, now, KSGetCount);
@@ -615,7 +1107,6 @@ struct SBSkiplist {
     os << "----------Print KSIterate----------" << std::endl;
     d.PrintTo(os, now, KSIterateCount);
     os << "----------Print Statistics End----------" << std::endl;
-    delete iter;
   }
  public:
   std::string ToString() const {
@@ -650,10 +1141,9 @@ struct SBSkiplist {
   }
   SBSNode* GetHead() const { return head_; }
   bool isDirty() const {
-    auto iter = NewIterator();
-    iter->SeekDirty();
-    bool dirty = (iter->Current().height_ > 0);
-    delete iter;
+    SBSIterator iter(head_);
+    iter.SeekDirty();
+    bool dirty = (iter.Current().height_ > 0);
     return dirty;
   }
 
@@ -662,7 +1152,7 @@ struct SBSkiplist {
       size_t height = node->Height();
       for (size_t h = 1; h < height; ++h) {
         auto &table = node->GetLevel(h)->table_;
-        table.hottest_ = nullptr;
+        table.hot_.Invalidate();
         table.SetDirty(true);
       }
     }
@@ -685,17 +1175,89 @@ struct SBSkiplist {
       //  iter.CheckAbsorbEmptyNext(options_);
     }
   }
-  size_t Level0Size(size_t* cap = nullptr) {
-    for (size_t i = 0; i < head_->Height(); ++i) {
-      LevelNode* lnode = head_->GetLevel(i);
-      if (head_->Next(i) == nullptr) {
-        size_t size = lnode->buffer_.HoleSize();
-        if (cap)
-          *cap = 0.01 * lnode->table_[HoleFileCapacity];
-        return size;
-      }
+  // Walk the tree once and export the tables computed by the last
+  // UpdateAllTable() (i.e. the last compaction pick).
+  void CollectMetrics(MetricsCollector& collector) const {
+    collector.Reset();
+    for (auto node = head_; node != nullptr; node = node->Next(0)) {
+      size_t height = node->Height();
+      for (size_t h = 1; h < height; ++h)
+        collector.AddNode(node->Guard(), h, node->GetLevel(h)->table_);
     }
-    return 0;
+    collector.Finish();
+    size_t cap = 0;
+    size_t level0 = Level0Size(&cap);
+    collector.AddGlobal("level0_size", level0);
+    collector.AddGlobal("level0_capacity", cap);
+    CompactionDebt debt;
+    EstimateCompactionDebt(debt);
+    collector.AddGlobal("pending_compaction_read_bytes", debt.ReadBytes());
+    collector.AddGlobal("pending_compaction_write_bytes", debt.WriteBytes());
+  }
+  // Bytes the tree needs to compact, estimated from the tables of the last
+  // UpdateAllTable(). A node needs compaction when its hole files cover
+  // more runs than HoleFileCapacity, it is too wide, or it is a level 0
+  // with Level0CompactionSize() files. Its hole files are then read and
+  // written once, with the overlapped leaves in level 1, and are written
+  // once more in every height below as they sink.
+  struct CompactionDebt {
+    std::vector<uint64_t> read_bytes_;
+    std::vector<uint64_t> write_bytes_;
+    uint64_t ReadBytes() const { 
+      uint64_t total = 0;
+      for (auto b : read_bytes_) total += b;
+      return total;
+    }
+    uint64_t WriteBytes() const { 
+      uint64_t total = 0;
+      for (auto b : write_bytes_) total += b;
+      return total;
+    }
+  };
+  void EstimateCompactionDebt(CompactionDebt& debt) const {
+    size_t height = head_->Height();
+    debt.read_bytes_.assign(height, 0);
+    debt.write_bytes_.assign(height, 0);
+    size_t level0 = Level0Height();
+    for (auto node = head_; node != nullptr; node = node->Next(0))
+      for (size_t h = 1; h < node->Height(); ++h) {
+        LevelNode* lnode = node->GetLevel(h);
+        auto& table = lnode->table_;
+        uint64_t bytes = table[HoleFileSize];
+        if (bytes == 0) continue;
+        bool over = table[HoleFileRuns] * 100 > std::max<uint64_t>(table[HoleFileCapacity], 100) ||
+                    table[NodeWidthScore] > 0 ||
+                    (node == head_ && h == level0 && 
+                     table[HoleFileCount] >= options_.Level0CompactionSize());
+        if (!over) continue;
+        uint64_t leaves = 0;
+        if (h == 1) 
+          for (SBSNode* c = node; c != node->Next(1); c = c->Next(0))
+            for (BFile* file : c->GetLevel(0)->buffer_)
+              if (lnode->buffer_.Compare(*file) == BOverlap)
+                leaves += file->Data()->file_size;
+        debt.read_bytes_[h] += bytes + leaves;
+        debt.write_bytes_[h] += bytes + leaves;
+        for (size_t k = 1; k < h; ++k) {
+          debt.read_bytes_[k] += bytes;
+          debt.write_bytes_[k] += bytes;
+        }
+      }
+  }
+  // The lowest height of the head without a next node, Height() if none.
+  size_t Level0Height() const {
+    size_t i = 0;
+    while (i < head_->Height() && head_->Next(i) != nullptr) ++i;
+    return i;
+  }
+  size_t Level0Size(size_t* cap = nullptr) const {
+    size_t i = Level0Height();
+    if (i == head_->Height()) 
+      return 0;
+    LevelNode* lnode = head_->GetLevel(i);
+    if (cap)
+      *cap = 0.01 * lnode->table_[HoleFileCapacity];
+    return lnode->buffer_.HoleSize();
   }
 };
 
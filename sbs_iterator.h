@@ -1,6 +1,10 @@
 #pragma once
 
 #include <stack>
+#include <array>
+#include <set>
+#include <algorithm>
+#include <thread>
 #include <unordered_set>
 #include "sbs_node.h"
 #include "scorer.h"
@@ -11,6 +15,7 @@ namespace sagitrs {
 struct Coordinates {
   SBSNode::SBSP node_;
   size_t height_;
+  Coordinates() : node_(nullptr), height_(0) {}
   Coordinates(SBSNode::SBSP node, size_t height) 
   : node_(node), height_(height) {}
   
@@ -48,7 +53,7 @@ struct Coordinates {
     return node_->GetTreeStatistics(height_); }
   const Statistics* GetNodeStatistics() { 
     return node_->GetNodeStatistics(height_); }
-  void SetStatisticsDirty() { node_->GetLevel(height_)->table_.SetDirty(); }
+  void SetStatisticsDirty() { node_->GetLevel(height_)->SetDirty(); }
   //bool operator ==(const Coordinates& b) { return node_ == b.node_; }
   bool IsDirty() const { return node_->GetLevel(height_)->isDirty(); }
   void GetRanges(BFileVec& results, const Bounded* key = nullptr) {
@@ -82,6 +87,9 @@ struct Coordinates {
   BFile* GetHottest(int64_t time) { 
     return node_->GetHottest(height_, time); 
   }
+  const HotRanges& GetHotRanges(int64_t time) { 
+    return node_->GetHotRanges(height_, time); 
+  }
   LevelNode::VariableTable& Table() { return node_->GetLevel(height_)->table_; }
   std::string ToString() const {
     std::string node = node_->Guard().ToString();
@@ -94,26 +102,36 @@ struct Coordinates {
   }
 };
 
-struct CoordinatesStack : private std::vector<Coordinates> {
+// Route from the root to a node, one coordinate per height. The height of
+// the tree is bounded, so the route is kept inline and copying it or
+// walking it never allocates.
+struct CoordinatesStack {
+ public:
+  // One coordinate per level of the head.
+  static const size_t kCapacity = SBSNodeOptions::MaxTreeHeight;
+ private:
+  std::array<Coordinates, kCapacity> c_;
+  size_t size_;
  public: 
-  virtual ~CoordinatesStack() {}
-  size_t Size() const { return std::vector<Coordinates>::size(); }
-  bool Empty() const { return empty(); }
+  CoordinatesStack() : c_(), size_(0) {}
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
 
-  Coordinates& Top() { return *rbegin(); }
-  Coordinates& Bottom(){ return *begin(); }
-  const Coordinates& Top() const { return *rbegin(); }
-  const Coordinates& Bottom() const { return *begin(); }
-  Coordinates& operator[](size_t k) { return std::vector<Coordinates>::operator[](k); }
-  const Coordinates& operator[](size_t k) const { return std::vector<Coordinates>::operator[](k); }
-  Coordinates& reverse_at(size_t k) { return (*this)[size() - 1 - k]; }
+  Coordinates& Top() { return c_[size_ - 1]; }
+  Coordinates& Bottom(){ return c_[0]; }
+  const Coordinates& Top() const { return c_[size_ - 1]; }
+  const Coordinates& Bottom() const { return c_[0]; }
+  Coordinates& operator[](size_t k) { return c_[k]; }
+  const Coordinates& operator[](size_t k) const { return c_[k]; }
+  Coordinates& reverse_at(size_t k) { return (*this)[size_ - 1 - k]; }
 
-  inline void Push(const Coordinates& coor) { push_back(coor); }
+  inline void Push(const Coordinates& coor) { 
+    assert(size_ < kCapacity);
+    c_[size_++] = coor; 
+  }
   Coordinates Pop() {
-    assert(!empty());
-    Coordinates result = *rbegin();
-    pop_back();
-    return result;
+    assert(size_ > 0);
+    return c_[--size_];
   }
   
  public:// iterator related:
@@ -123,9 +141,9 @@ struct CoordinatesStack : private std::vector<Coordinates> {
     int curr_;
    public:
     CoordinatesStackIterator(CoordinatesStack* stack) : stack_(stack), curr_(-1) {}
-    bool Valid() const { return (0 <= curr_) && (curr_ < stack_->size()); }
+    bool Valid() const { return (0 <= curr_) && (curr_ < stack_->Size()); }
     void SeekToFirst() { curr_ = 0; }
-    void SeekToLast() { curr_ = stack_->size() - 1; }
+    void SeekToLast() { curr_ = stack_->Size() - 1; }
     void Prev() { curr_ --; }
     void Next() { curr_ ++; }
     
@@ -134,13 +152,13 @@ struct CoordinatesStack : private std::vector<Coordinates> {
   };
 
   void Resize(size_t k) {
-    assert(k <= size());
-    erase(begin() + k, end());
+    assert(k <= size_);
+    size_ = k;
   }
-  void Clear() { clear(); }
+  void Clear() { size_ = 0; }
   void SetToIterator(const CoordinatesStackIterator& iter) { Resize(iter.CurrentCursor() + 1); }
-  CoordinatesStackIterator* NewIterator() const {
-    return new CoordinatesStackIterator(const_cast<CoordinatesStack*>(this));
+  CoordinatesStackIterator Iterator() const {
+    return CoordinatesStackIterator(const_cast<CoordinatesStack*>(this));
   }
 };
 
@@ -225,17 +243,15 @@ struct SBSIterator : public Printable {
   // ---------------------iterator operation end-----------------
  public:
   bool SeekNode(Coordinates target) {
-    RealBounded bound(target.node_->Guard(), target.node_->Guard());
+    SliceBounded bound(target.node_->Guard(), target.node_->Guard());
     SeekRange(bound, false);
-    auto iter = s_.NewIterator();
-    for (iter->SeekToLast(); iter->Valid(); iter->Prev()) {
-      if (iter->Current() == target) {
-        s_.SetToIterator(*iter);
-        delete iter;
+    auto iter = s_.Iterator();
+    for (iter.SeekToLast(); iter.Valid(); iter.Prev()) {
+      if (iter.Current() == target) {
+        s_.SetToIterator(iter);
         return 1;
       }
     }
-    delete iter;
     SeekToRoot();
     return 0;
   }
@@ -272,7 +288,7 @@ struct SBSIterator : public Printable {
           return;
       }
     } else {
-      RealBounded bound(key, key);
+      SliceBounded bound(key, key);
       SeekRange(bound);
       if (Current().height_ > 0) {
         SeekToFirst(0);
@@ -314,20 +330,34 @@ struct SBSIterator : public Printable {
   // (including ranges and values).
   // Assert: Already SeekRange().
   BFile* SeekValueInRoute(uint64_t id) {
-    auto iter = s_.NewIterator();
+    auto iter = s_.Iterator();
     BFile* res = nullptr;
-    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
-      res = iter->Current().GetValue(id);
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
+      res = iter.Current().GetValue(id);
       if (res) {
-        s_.SetToIterator(*iter);
-        delete iter;
+        s_.SetToIterator(iter);
         return res;
       }
     }
-    delete iter;
     return nullptr;
   }
   
+  // SeekRange(range) and SeekValueInRoute(id), but when index is given the
+  // height of the file is known, so no buffer on the route is scanned.
+  BFile* SeekFile(const Bounded& range, uint64_t id, FileIndex* index) {
+    SeekRange(range);
+    if (index == nullptr)
+      return SeekValueInRoute(id);
+    FileIndex::Entry entry;
+    if (!index->Find(id, entry))
+      return nullptr;
+    for (size_t i = s_.Size(); i > 0; --i)
+      if (s_[i - 1].node_ == entry.node_ && s_[i - 1].height_ == entry.height_) {
+        s_.Resize(i);
+        return entry.file_;
+      }
+    return nullptr;
+  }
   void SeekDirty() {
     for (int height = SBSHeight() - 1; height > 0; --height) {
       SeekToRoot();
@@ -372,48 +402,78 @@ struct SBSIterator : public Printable {
     s_ = max_stack;
     return scorer.MaxScore();
   }
-  bool CheckSplit(const SBSOptions& options) {
-    auto iter = s_.NewIterator();
+  // leaf_only: only split leaves, nodes above are left to SBSkiplist::Rebalance().
+  bool CheckSplit(const SBSOptions& options, bool leaf_only = false) {
+    auto iter = s_.Iterator();
     bool update = false;
-    for (iter->SeekToLast(); iter->Valid() && iter->Current().TestState(options) > 0; iter->Prev()) {
-      while (iter->Current().TestState(options) > 0) {
-        bool ok = iter->Current().SplitNext(options);
+    for (iter.SeekToLast(); iter.Valid() && iter.Current().TestState(options) > 0; iter.Prev()) {
+      if (leaf_only && iter.Current().height_ > 0) break;
+      while (iter.Current().TestState(options) > 0) {
+        bool ok = SplitOnRoute(options, iter.CurrentCursor());
         // node is dirty.
         if (!ok) {
-          SeekNode(iter->Current());
+          SeekNode(iter.Current());
           return false;
         } 
       }
     }
-    delete iter;
     return true;
   }
+  // Split every node on the route wider than its range, deepest first,
+  // except the root. Return false as CheckSplit() does.
+  bool SplitRoute(const SBSOptions& options) {
+    auto iter = s_.Iterator();
+    for (iter.SeekToLast(); iter.Valid() && iter.CurrentCursor() > 0; iter.Prev())
+      while (iter.Current().TestState(options) > 0) 
+        if (!SplitOnRoute(options, iter.CurrentCursor())) {
+          SeekNode(iter.Current());
+          return false;
+        }
+    return true;
+  }
+  // Split the node at depth k of the route. The table of its parent counts
+  // its children, so the parent is rescored too.
+  bool SplitOnRoute(const SBSOptions& options, size_t k, BFileVec* force = nullptr) {
+    if (!s_[k].SplitNext(options, force))
+      return false;
+    if (k > 0) 
+      s_[k - 1].SetStatisticsDirty();
+    return true;
+  }
+  bool SplitCurrent(const SBSOptions& options, BFileVec* force = nullptr) {
+    return SplitOnRoute(options, s_.Size() - 1, force);
+  }
  public:
-  void DisableRouteHottest() {
+  // Assert: target was the leaf file of the current node.
+  void DisableRouteHottest(const BFile& target) {
     assert(Current().height_ == 0);
-    auto iter = s_.NewIterator();
-    iter->SeekToLast();
-    auto target = iter->Current().Buffer()[0];
-    for (iter->Prev(); iter->Valid(); iter->Prev()) {
-      auto &h = iter->Current().Table().hottest_;
-      auto &t = iter->Current().Table().update_time_;
-      if (h != nullptr && h->Identifier() == target->Identifier())
-        h = nullptr;
-      else
-        break;
+    auto iter = s_.Iterator();
+    iter.SeekToLast();
+    for (iter.Prev(); iter.Valid(); iter.Prev())
+      iter.Current().Table().hot_.Remove(target.Identifier());
+  }
+  // Offer the new read count of a leaf file to every subtree on the route.
+  // Assert: Already SeekValueInRoute(target).
+  void UpdateRouteHottest(BFile* target, int64_t time) {
+    if (Current().height_ != 0) return;
+    auto iter = s_.Iterator();
+    iter.SeekToLast();
+    int64_t count = target->GetStatistics(KSGetCount, time);
+    for (iter.Prev(); iter.Valid(); iter.Prev()) {
+      auto &hot = iter.Current().Table().hot_;
+      if (hot.Valid(time))
+        hot.Offer(*target, count);
     }
-    delete iter;
   }
   void SetRouteStatisticsDirty() {
-    auto iter = s_.NewIterator();
-    iter->SeekToLast();
-    assert(iter->Valid());
-    iter->Current().Buffer().SetStatsDirty();
-    for (; iter->Valid(); iter->Prev()) 
-      iter->Current().SetStatisticsDirty();
-    delete iter;
-  }
-  bool Add(const SBSOptions& options, SBSNode::ValuePtr value) {
+    auto iter = s_.Iterator();
+    iter.SeekToLast();
+    assert(iter.Valid());
+    iter.Current().Buffer().SetStatsDirty();
+    for (; iter.Valid(); iter.Prev()) 
+      iter.Current().SetStatisticsDirty();
+  }
+  bool Add(const SBSOptions& options, SBSNode::ValuePtr value, bool leaf_only = false) {
     SeekRange(*value, true);
     //UpdateTargetStatistics(value->Identifier(), DefaultTypeLabel::LeafCount, 1, options.NowTimeSlice());
     if (s_.Top().height_ == 0) 
@@ -421,27 +481,32 @@ struct SBSIterator : public Printable {
     SetRouteStatisticsDirty();
     s_.Top().Add(options, value);
     //SetRouteStatisticsDirty();
-    bool state = CheckSplit(options);
+    bool state = CheckSplit(options, leaf_only);
     return state;
   }
+  // Whether every node on the route, except the root, has a valid width.
+  bool RouteBalanced(const SBSOptions& options) const {
+    for (size_t i = 1; i < s_.Size(); ++i)
+      if (s_[i].height_ > 0 && s_[i].TestState(options) != 0)
+        return false;
+    return true;
+  }
   //std::vector<std::pair<size_t, SBSNode::ValuePtr>>& Recycler() { return recycler_; }
  private:
  public:
   // Get all the values on the path that are overlap with the given range.
   void GetBufferOnRoute(BFileVec& results, const Slice& key) const {
-    auto iter = s_.NewIterator();
-    for (iter->SeekToLast(); iter->Valid(); iter->Prev())
-      iter->Current().GetCovers(results, key);
-    delete iter;
+    auto iter = s_.Iterator();
+    for (iter.SeekToLast(); iter.Valid(); iter.Prev())
+      iter.Current().GetCovers(results, key);
   }
   void GetBufferOnRoute(std::vector<BFile*>& results) const {
-    auto iter = s_.NewIterator();
-    for (iter->SeekToLast(); iter->Valid(); iter->Prev()) {
-      BFileVec& buffer = iter->Current().Buffer();
+    auto iter = s_.Iterator();
+    for (iter.SeekToLast(); iter.Valid(); iter.Prev()) {
+      BFileVec& buffer = iter.Current().Buffer();
       for (BFile* file : buffer) 
         results.push_back(file);
     }
-    delete iter;
   }
   
   void GetBufferInCurrent(BFileVec& results) { 
@@ -468,27 +533,73 @@ struct SBSIterator : public Printable {
   // Assume: The current node contains the target value.
   // Delete a value within the current node which is the same as the given value.
   // This may recursively trigger a merge operation and possibly a split operation.
-  void Reinsert(const SBSOptions& options) {
+  void Reinsert(const SBSOptions& options, bool leaf_only = false) {
     //assert(reinserter_.empty());
-    for (auto e : reinserter_) if (e != nullptr) {
-      BFile* deleted = Del_(options, *e);
-      //assert(deleted->DeletedLevel() > 0);
-      if (deleted)
-        Add(options, e);
-      deleted->SetDeletedLevel(-1);
+    // Removing files may displace more, so take the queue before walking it.
+    // Each round removes its files together, then puts them back.
+    while (!reinserter_.empty()) {
+      std::vector<SBSNode::ValuePtr> files, deleted;
+      files.swap(reinserter_);
+      std::sort(files.begin(), files.end());
+      files.erase(std::unique(files.begin(), files.end()), files.end());
+      files.erase(std::remove(files.begin(), files.end(), nullptr), files.end());
+      DelBatch_(options, files, deleted, leaf_only);
+      for (auto e : deleted) {
+        Add(options, e, leaf_only);
+        e->SetDeletedLevel(-1);
+      }
+    }
+  }
+  // Delete a set of files in one sweep, in key order. Emptied leaves are
+  // absorbed at once as Del() does, but an inner node that lost files is
+  // checked once after the sweep, and the hole files displaced are 
+  // reinserted together. Deleted files are appended to deleted.
+  void DelBatch(const SBSOptions& options, const std::vector<BFile*>& files,
+                std::vector<BFile*>& deleted, bool leaf_only = false) {
+    DelBatch_(options, files, deleted, leaf_only);
+    Reinsert(options, leaf_only);
+  }
+  void DelBatch_(const SBSOptions& options, std::vector<BFile*> files,
+                 std::vector<BFile*>& deleted, bool leaf_only) {
+    std::sort(files.begin(), files.end(), [](BFile* a, BFile* b) {
+      return a->Min().compare(b->Min()) < 0;
+    });
+    std::set<std::pair<SBSNode*, size_t>> touched;
+    std::vector<std::pair<std::string, size_t>> routes;
+    for (BFile* file : files) {
+      BFile* res = Remove(options, *file);
+      if (res == nullptr) 
+        continue;
+      deleted.push_back(res);
+      auto target = s_.Top();
+      if (target.height_ == 0) 
+        CheckRemoved(options, leaf_only);
+      else if (touched.emplace(target.node_, target.height_).second)
+        routes.emplace_back(file->Min().ToString(), target.height_);
+    }
+    // nodes may have been absorbed since, seek them again by key.
+    for (auto& route : routes) {
+      SliceBounded bound(route.first, route.first);
+      SeekRange(bound);
+      while (s_.Size() > 1 && s_.Top().height_ < route.second)
+        s_.Pop();
+      CheckRemoved(options, leaf_only);
     }
-    reinserter_.clear();
+    SeekToRoot();
   }
-  BFile* Del(const SBSOptions& options, const BFile& file, bool auto_reinsert = true) {
-    BFile* deleted = Del_(options, file);
+  BFile* Del(const SBSOptions& options, const BFile& file, 
+             bool auto_reinsert = true, bool leaf_only = false) {
+    BFile* deleted = Del_(options, file, leaf_only);
+    if (deleted == nullptr) 
+      return nullptr;
     int level = deleted->DeletedLevel();
     if (level == -1) 
       return nullptr;
     if (auto_reinsert || level == 0) 
-      Reinsert(options);
+      Reinsert(options, leaf_only);
     return deleted;
   }
-  BFile* Del_(const SBSOptions& options, const BFile& file) {
+  BFile* Del_(const SBSOptions& options, const BFile& file, bool leaf_only = false) {
     // 1. Delete file in target node.
     // 2. (for inner node) check if split happens. if so, stop here.
     // 3. (for leaf node) check if node became empty. if so, check absorb recursively.
@@ -497,44 +608,59 @@ struct SBSIterator : public Printable {
     //   3. recalculate node status.
     //   4. check if child node is less enough to check absorb recursively.
     // 4. recalculate all nodes' child-state.
-    SeekToRoot(); Slice a(file.Min()), b(file.Max());
-    SeekRange(file);
-    auto res0 = SeekValueInRoute(file.Identifier());
-    if (res0 == nullptr) 
+    BFile* res = Remove(options, file);
+    if (res == nullptr) 
       return nullptr;
-    //if (s_.Top().height_ == 0) s_.Top().->UpdateStatistics(DefaultTypeLabel::LeafCount, 1, options.NowTimeSlice());           // inc leaf.
-    //SetRouteStatisticsDirty();
-
-    auto target = s_.Top();
-    BFile* res = target.Del(file);
-
-    assert(res != nullptr);
-    if (s_.Top().height_ == 0) {
-      res->UpdateStatistics(DefaultTypeLabel::LeafCount, -1, options.NowTimeSlice());         // statistics.
-      DisableRouteHottest();
-    }
-    SetRouteStatisticsDirty();
     //deleted = res.second;
     //if (recycle) recycler_.push_back(res);
-
+    CheckRemoved(options, leaf_only);
+    return res;
+  }
+  // Assert: a file was just removed from the current node.
+  void CheckRemoved(const SBSOptions& options, bool leaf_only) {
+    auto target = s_.Top();
     // for inner node:
     // check if recursively split is triggered.
     size_t height = target.height_;
     int state = target.TestState(options);
     if (height > 0 && state > 0 && !target.IsDirty()) {
-      CheckSplit(options);
-      return res;
+      CheckSplit(options, leaf_only);
+      return;
     }
 
     // for leaf node:
     // check if recursively absorb is triggered.
-    CheckAbsorb(options);
+    CheckAbsorb(options, leaf_only);
+  }
+
+  // Remove file from the node holding it, without any split or absorb.
+  // The route to that node is left in the stack.
+  BFile* Remove(const SBSOptions& options, const BFile& file) {
+    FileIndex* index = options.file_index_;
+    if (index && !index->Contains(file.Identifier()))
+      return nullptr;
+    auto res0 = SeekFile(file, file.Identifier(), index);
+    if (res0 == nullptr) 
+      return nullptr;
+    //if (s_.Top().height_ == 0) s_.Top().->UpdateStatistics(DefaultTypeLabel::LeafCount, 1, options.NowTimeSlice());           // inc leaf.
+    //SetRouteStatisticsDirty();
+
+    auto target = s_.Top();
+    BFile* res = target.Del(file);
 
+    assert(res != nullptr);
+    if (target.height_ == 0) {
+      res->UpdateStatistics(DefaultTypeLabel::LeafCount, -1, options.NowTimeSlice());         // statistics.
+      DisableRouteHottest(*res);
+    }
+    SetRouteStatisticsDirty();
     return res;
   }
-
-  void CheckAbsorb(const SBSOptions& options) {
+  void CheckAbsorb(const SBSOptions& options, bool leaf_only = false) {
     for (auto target = s_.Pop(); s_.Size() > 1; target = s_.Pop()) {
+      // a node left with one child is absorbed anyway, or that child could 
+      // not be absorbed when it is emptied.
+      if (leaf_only && target.height_ > 0 && target.Width() > 1) break;
       size_t height = target.height_;
       auto st = s_.Top().DownNode(), ed = s_.Top().NextNode().DownNode();
 
@@ -559,6 +685,7 @@ struct SBSIterator : public Printable {
         }
         // now we need target node to absorb the next node.
         target.AbsorbNext(options);
+        s_.Top().SetStatisticsDirty();
       }
 
       // Check file bound since guard in this tree has changed.
@@ -588,6 +715,7 @@ struct SBSIterator : public Printable {
         auto old1 = next->GetLevel(height);
         auto newlnode = new LevelNode(*old1);
         newlnode->buffer_.AddAll(old0->buffer_);
+        newlnode->reserved_ = old0->reserved_ || old1->reserved_;
 
         target.node_->SetLevel(height, newlnode);
         next->SetLevel(height, nullptr);
@@ -595,21 +723,28 @@ struct SBSIterator : public Printable {
         delete old0;
         delete old1;
         target.node_->Rebound();
-        next->Rebound();
+        // an absorbed leaf is not linked at any height anymore.
+        if (height == 0)
+          delete next;
+        else
+          next->Rebound();
+        s2.Top().SetStatisticsDirty();
       }
     }
   }
 
   virtual void GetStringSnapshot(std::vector<KVPair>& snapshot) const override {
-    auto iter = s_.NewIterator();
-    for (iter->SeekToFirst(); iter->Valid(); iter->Next())
-      snapshot.emplace_back("", iter->Current().ToString());
-    delete iter;
+    auto iter = s_.Iterator();
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next())
+      snapshot.emplace_back("", iter.Current().ToString());
   }
 
+  // Bids for hole file capacity go to market, priced with model, which
+  // the caller reads once per update (it may lock, see CostCalibrator).
   void UpdateTable(Statistable::TypeTime now, 
                    const LevelNode::VariableTable* gtable = nullptr,
-                   std::vector<std::pair<Coordinates, double>>* market = nullptr) {
+                   std::vector<std::pair<Coordinates, double>>* market = nullptr,
+                   const CostModel* model = nullptr) {
     size_t height = Current().height_;
     BFileVec& buffer = Current().Buffer();
     if (height == 0) return;
@@ -629,6 +764,7 @@ struct SBSIterator : public Printable {
     uint64_t bytes = stats->GetStatistics(KSBytesCount, STATISTICS_ALL);
     uint64_t entries = stats->GetStatistics(KSPutCount, STATISTICS_ALL);
     table[BytePerKey] = entries == 0 ? 1024 : bytes / entries;
+    table[LocalDelete]  = stats->GetStatistics(KSDeleteCount, STATISTICS_ALL);
     //assert(entries > 0);
     if (!gtable) gtable = &table;
       
@@ -655,7 +791,11 @@ struct SBSIterator : public Printable {
 
     BFileVec children;
     Current().node_->GetChildGuard(height, &children);
+    uint64_t deletes = 0;
     for (BFile* file : buffer) {
+      // inputs of a running compaction are not pending work.
+      if (file->Reserved()) continue;
+      deletes += file->GetStatistics(KSDeleteCount, STATISTICS_ALL);
       if (file->Type() == BFile::TypeHole) {
         table[HoleFileCount]++;
         table[HoleFileSize] += file->Data()->file_size;
@@ -670,24 +810,31 @@ struct SBSIterator : public Printable {
     table[TotalFileSize]  = table[HoleFileSize]  + table[TapeFileSize];
     table[TotalFileRuns]  = table[HoleFileRuns]  + table[TapeFileRuns];
 
+    if (table[TotalFileSize] > 0) {
+      uint64_t entries = table[TotalFileSize] / std::max<uint64_t>((*gtable)[BytePerKey], 1);
+      table[TombstoneDensity] = std::min<uint64_t>(1000, 1000 * deletes / std::max<uint64_t>(entries, 1));
+    }
+
     if (market) {
       //double WWeight = (100.0 + table[LocalWrite]) / (100.0 + 1.0 * table[LocalWrite] + 0.2 * table[LocalGet] + 10000.0 * table[LocalIterate]);
       
       {
-        double alpha = 0.5;
-        double page_size = 4096;
+        assert(model != nullptr);
+        double alpha = model->alpha_;
+        double page_size = model->page_size_;
         double cost[options.MaxWidth() + 2];
         
-        double write = table[LocalWrite];
+        double write = table[LocalWrite] * model->write_weight_;
         double get = table[LocalGet];
-        double iter = table[LocalIterate];
+        double iter = table[LocalIterate] * model->scan_weight_;
         double min_get = aread * table[LocalLeaf] * 0.01;
         if (get < min_get) get = min_get;
+        get *= model->read_weight_;
         double rsize = (*gtable)[BytePerKey];
         assert(rsize > 0);
         double B = page_size;
-        double p = 0.001;
-        double q = 0.5;
+        double p = model->bloom_fp_;
+        double q = model->block_fraction_;
         
         double T = width;
         if (T < options.MinWidth() && height >= 3 && Current().node_->IsHead())
@@ -715,27 +862,96 @@ struct SBSIterator : public Printable {
     if (emit < 0) emit = 0;
     
     table[NodeWidthScore] = 100ULL * emit / options.MaxWidth() * 2;
+
+    // A get through this node probes TotalFileRuns / width files on average,
+    // all but one are wasted until the buffer is merged. As in leveldb, 
+    // a wasted probe costs as much as compacting SeekCompactionBytes().
+    double probes = width > 0 ? 1.0 * table[TotalFileRuns] / width : 0;
+    if (probes > 1 && table[TotalFileSize] > 0)
+      table[ReadSeekScore] = 100.0 * table[LocalGet] * (probes - 1) * 
+                             options.SeekCompactionBytes() / table[TotalFileSize];
+  }
+  // Update the table of the given node only. The hole file capacity 
+  // assigned by the last UpdateAllTable() is kept, a node built since has 
+  // the capacity UpdateAllTable() gives a node without bids.
+  void UpdateTableAt(const Coordinates& coord, Statistable::TypeTime now, 
+                     const LevelNode::VariableTable* gtable) {
+    s_.Push(coord);
+    uint64_t capacity = Current().Table()[HoleFileCapacity];
+    UpdateTable(now, gtable, nullptr);
+    Current().Table()[HoleFileCapacity] = capacity > 0 ? capacity : 100;
+    s_.Pop();
+  }
+  // Update the tables of root and of all nodes under it.
+  void UpdateSubtreeTable(const Coordinates& root, Statistable::TypeTime now, 
+                          const LevelNode::VariableTable* gtable,
+                          std::vector<std::pair<Coordinates, double>>* market,
+                          const CostModel* model) {
+    SBSNode* ed = root.Next();
+    s_.Clear();
+    for (int height = root.height_; height > 0; --height) 
+      for (SBSNode* node = root.node_; node != ed; node = node->Next(height)) {
+        s_.Push(Coordinates(node, height));
+        UpdateTable(now, gtable, market, model);
+        s_.Pop();
+      }
+    SeekToRoot();
   }
-  void UpdateAllTable() {
-    Statistable::TypeTime now = head_->options_.NowTimeSlice();
+  // Subtrees under different children of the root are independent, so
+  // with threads > 1 they are updated by a pool of workers, each with its
+  // own market. Small trees are always updated serially.
+  void UpdateAllTable(size_t threads = 1) {
+    const SBSOptions& options = head_->options_;
+    Statistable::TypeTime now = options.NowTimeSlice();
     SeekToRoot();
     LevelNode::VariableTable& gtable = Current().Table();
     std::vector<std::pair<Coordinates, double>> market;
+    const CostModel model = options.GetCostModel();
     UpdateTable(now);
-    for (int height = SBSHeight() - 1; height > 0; --height) {
+    if (threads <= 1 || SBSHeight() < 3 || 
+        gtable[LocalLeaf] < options.ParallelUpdateMinLeaves()) {
+      for (int height = SBSHeight() - 1; height > 0; --height) {
+        SeekToRoot();
+        for (Dive(SBSHeight() - 1 - height); Valid(); Next()) 
+          //UpdateTable(now, &gtable, nullptr);
+          UpdateTable(now, &gtable, &market, &model);
+      }
+    } else {
+      // the root first, all statistics are merged by then.
+      UpdateTable(now, &gtable, &market, &model);
+      std::vector<Coordinates> subtrees;
+      for (Coordinates c(head_, SBSHeight() - 2); c.Valid(); c.JumpNext())
+        subtrees.push_back(c);
+      std::vector<std::vector<std::pair<Coordinates, double>>> markets(subtrees.size());
+      std::atomic<size_t> cursor(0);
+      auto worker = [&]() {
+        SBSIterator iter(head_);
+        for (size_t i = cursor++; i < subtrees.size(); i = cursor++)
+          iter.UpdateSubtreeTable(subtrees[i], now, &gtable, &markets[i], &model);
+      };
+      std::vector<std::thread> pool;
+      for (size_t i = 1; i < threads && i < subtrees.size(); ++i)
+        pool.emplace_back(worker);
+      worker();
+      for (auto& t : pool) 
+        t.join();
+      for (auto& m : markets)
+        market.insert(market.end(), m.begin(), m.end());
       SeekToRoot();
-      for (Dive(SBSHeight() - 1 - height); Valid(); Next()) 
-        //UpdateTable(now, &gtable, nullptr);
-        UpdateTable(now, &gtable, &market);
     }
-    std::sort(market.begin(), market.end(), 
-      [](std::pair<Coordinates, double>& a, std::pair<Coordinates, double> b) {
-        return a.second > b.second;});
     size_t data_size = gtable[LocalLeaf];// > 1000 ? gtable[LocalLeaf] : 1000;
-    size_t capacity = 2.0 * data_size * head_->options_.SpaceAmplificationConst();
+    size_t capacity = 2.0 * data_size * options.SpaceAmplificationConst();
     size_t market_size = market.size();
     if (capacity > market.size()) 
       capacity = market.size();
+    // only the first capacity bids are needed, in any order. Ties are 
+    // broken by node, so the winners do not depend on the market order.
+    if (capacity < market.size())
+      std::nth_element(market.begin(), market.begin() + capacity, market.end(), 
+        [](const std::pair<Coordinates, double>& a, const std::pair<Coordinates, double>& b) {
+          if (a.second != b.second) return a.second > b.second;
+          if (a.first.node_ != b.first.node_) return a.first.node_ < b.first.node_;
+          return a.first.height_ < b.first.height_;});
     for (size_t i = 0; i < capacity; ++i) {
       auto &runs = market[i].first.Table()[HoleFileCapacity];
       runs += 100;
@@ -4,6 +4,7 @@
 #include <vector>
 #include <stack>
 #include <memory>
+#include <tuple>
 #include "db/dbformat.h"
 #include "bounded.h"
 #include "bounded_value_container.h"
@@ -30,7 +31,7 @@ struct SBSNode : public Printable {
   bool is_head_;
 
   std::atomic<int> height_;
-  std::array<std::atomic<LevelNode*>, 6> level_;
+  std::array<std::atomic<LevelNode*>, SBSNodeOptions::MaxTreeHeight> level_;
 
   std::atomic<BFile*> pacesetter_;
  public:
@@ -41,6 +42,7 @@ struct SBSNode : public Printable {
     height_(height),
     level_(),
     pacesetter_(nullptr) {
+      assert(height <= level_.size());
       for (size_t i = 0; i < height; ++i) {
         SetLevel(i, new LevelNode(options, nullptr));
       }
@@ -76,7 +78,19 @@ struct SBSNode : public Printable {
     pacesetter_.store(file, std::memory_order_relaxed);
   }
   void SetLevel(size_t k, LevelNode* node) {
+    LevelNode* old = level_[k].load(std::memory_order_relaxed);
+    if (old && old != node && old->files_)
+      old->files_->Detach(old);
+    if (old && old != node && old->index_)
+      old->index_->Remove(old);
     level_[k].store(node, std::memory_order_relaxed);
+    if (node == nullptr) return;
+    node->owner_ = this;
+    node->height_ = k;
+    if (k > 0 && options_.score_index_)
+      options_.score_index_->SetDirty(node);
+    if (options_.file_index_)
+      options_.file_index_->Attach(node);
   }
   LevelNode* GetLevel(size_t height) const { 
     return level_[height].load(std::memory_order_relaxed); 
@@ -221,27 +235,53 @@ struct SBSNode : public Printable {
   }
   void IncHeight(LevelNode* lnode) {
     size_t h = Height();
+    assert(h < level_.size());
     SetLevel(h, lnode);
     SetHeight(h + 1);
   }
   const Statistics* GetNodeStatistics(size_t height) { return GetLevel(height)->buffer_.GetStatistics(); }
   
+  // Merge the hottest leaf files of the subtree rooted at node[height] into hot.
+  void MergeHotRanges(size_t height, int64_t time, HotRanges& hot) {
+    if (height == 0) {
+      BFile* file = GetLevel(0)->buffer_.GetOne();
+      if (file) 
+        hot.Offer(*file, file->GetStatistics(KSGetCount, time));
+      return;
+    }
+    hot.Merge(GetHotRanges(height, time));
+  }
+  const HotRanges& GetHotRanges(size_t height, int64_t time) {
+    assert(height > 0);
+    auto &h = GetLevel(height)->table_.hot_;
+    if (h.Valid(time))
+      return h;
+
+    h.Reset(options_.HotRangeCount(), time);
+    MergeHotRanges(height - 1, time, h);
+    for (SBSP i = Next(height - 1); i != Next(height); i = i->Next(height - 1))
+      i->MergeHotRanges(height - 1, time, h);
+    return h;
+  }
   BFile* GetHottest(size_t height, int64_t time) {
     if (height == 0) 
       return GetLevel(0)->buffer_.GetOne(); 
-    
-    auto &h = GetLevel(height)->table_.hottest_;
-    if (h != nullptr)
-      return h;
-
-    h = GetHottest(height - 1, time);
-    for (SBSP i = Next(height - 1); i != Next(height); i = i->Next(height - 1)) {
-      auto ch = i->GetHottest(height - 1, time);
-      if (h == nullptr || ch->GetStatistics(KSGetCount, time) > h->GetStatistics(KSGetCount, time))
-        h = ch;
+    const HotRange* hot = GetHotRanges(height, time).Hottest();
+    return hot ? FindLeaf(height, *hot) : nullptr;
+  }
+  // The leaf file of the subtree rooted at node[height] that holds range,
+  // nullptr if that file is no longer in the subtree.
+  BFile* FindLeaf(size_t height, const HotRange& range) {
+    SBSP node = this;
+    for (size_t h = height; h > 0; --h) {
+      SBSP ed = node->Next(h);
+      for (SBSP next = node->Next(h - 1); next != ed; next = next->Next(h - 1)) {
+        if (next->Guard().compare(range.Min()) > 0) break;
+        node = next;
+      }
     }
-    
-    return h;
+    BFile* file = node->GetLevel(0)->buffer_.GetOne();
+    return file && file->Identifier() == range.id_ ? file : nullptr;
   }
  public:
   const Statistics* GetTreeStatistics(size_t height) {
@@ -275,6 +315,49 @@ struct SBSNode : public Printable {
       s = new Statistics(options_, options_.NowTimeSlice());
     return s;
   }
+  // Pick the child where node[height] splits. Both halves must keep a 
+  // valid width; among those children, the one straddled by fewest buffer
+  // files wins, then the one balancing the sampled keys (options.table_)
+  // best, then the one closest to the default position reserve.
+  SBSP ChooseSplit(const SBSOptions& options, size_t height, size_t reserve) {
+    size_t width = Width(height);
+    SamplerTable* table = options.table_;
+    if (table && !table->Frozen()) table = nullptr;
+    SBSP next = Next(height);
+    size_t lo = is_head_ ? 1 : options.MinWidth();
+    size_t total = 0, base = 0;
+    if (table) {
+      base = table->GetCountSmallerOrEqualThan(Guard());
+      total = next ? table->GetCountSmallerOrEqualThan(next->Guard()) : table->TotalCount();
+    }
+    SBSP best = Next(height - 1, reserve);
+    size_t best_straddle = -1, best_skew = -1, best_distance = -1;
+    SBSP child = Next(height - 1);
+    for (size_t k = 1; k < width; ++k, child = child->Next(height - 1)) {
+      if (k < lo || k > options.MaxWidth()) continue;
+      if (width - k < options.MinWidth() || width - k > options.MaxWidth()) continue;
+      RealBounded div(child->Guard(), child->Guard());
+      size_t straddle = 0;
+      for (auto& v : GetLevel(height)->buffer_)
+        if (v->Compare(div) == BOverlap) 
+          straddle ++;
+      size_t skew = 0;
+      if (table) {
+        size_t left = table->GetCountSmallerOrEqualThan(child->Guard()) - base;
+        size_t right = total - base - left;
+        skew = left > right ? left - right : right - left;
+      }
+      size_t distance = k > reserve ? k - reserve : reserve - k;
+      if (std::make_tuple(straddle, skew, distance) < 
+          std::make_tuple(best_straddle, best_skew, best_distance)) {
+        best = child;
+        best_straddle = straddle;
+        best_skew = skew;
+        best_distance = distance;
+      }
+    }
+    return best;
+  }
   bool SplitNext(const SBSOptions& options, size_t height, BFileVec* force = nullptr) {
     if (height == 0) {
       auto &a = GetLevel(0)->buffer_;
@@ -292,7 +375,7 @@ struct SBSNode : public Printable {
       size_t reserve = width - options.DefaultWidth();
       assert(reserve > 1);
       SBSP next = Next(height);
-      SBSP middle = Next(height - 1, reserve);
+      SBSP middle = ChooseSplit(options, height, reserve);
       auto tmp = new LevelNode(options_, next);
       {
         // Check dirty problem.
@@ -327,9 +410,9 @@ struct SBSNode : public Printable {
       SetNext(height, middle);
       // if this node is root node, increase height.
       if (is_head_ && height + 1 == Height()) {
-        assert(false && "Error : try to increase tree height.");
         assert(next == nullptr);
-        //IncHeight(GetLevel(height)->node_stats_, nullptr);
+        assert(Height() < level_.size() && "Error : try to increase tree height.");
+        IncHeight(new LevelNode(options_, nullptr));
       }
       return 1;
     }
@@ -342,6 +425,9 @@ struct SBSNode : public Printable {
     GetLevel(height)->Absorb(next->GetLevel(height));
     Rebound();
     next->DecHeight();
+    // an absorbed leaf is not linked at any height anymore.
+    if (height == 0)
+      delete next;
   }
  public:
   virtual void GetStringSnapshot(std::vector<KVPair>& snapshot) const override {
@@ -0,0 +1,364 @@
+// Offline compaction simulator.
+// Drives an SBSkiplist with synthetic flushes and compactions built from
+// BFileEdit, without any I/O, and reports write/read/space amplification
+// and the latency of compaction picks. Useful to compare scorers and
+// options before running a real benchmark.
+//
+// Usage: sbs_sim [--workload=uniform|zipfian|sequential|scan|bulk]
+//                [--keys=N] [--flushes=N] [--keys_per_flush=N]
+//                [--value_size=N] [--reads_per_flush=N] [--policy=0..3]
+//                [--micros_per_flush=N] [--max_compaction_files=N]
+//                [--rebalance_routes=N] [--leaf_gap_moves=0|1]
+// Time is simulated, every flush advances the clock by micros_per_flush.
+// Trivial moves show with bulk runs longer than a file, for instance
+// --workload=bulk --keys=10000000 --keys_per_flush=16384 --leaf_gap_moves=1.
+
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "sbs.h"
+#include "bfile.h"
+#include "bfile_edit.h"
+
+namespace sagitrs {
+
+struct SimOptions {
+  std::string workload_ = "uniform";
+  uint64_t keys_ = 1000000;
+  uint64_t flushes_ = 2000;
+  uint64_t keys_per_flush_ = 4096;
+  uint64_t value_size_ = 1024;
+  uint64_t reads_per_flush_ = 256;
+  int policy_ = CostModel::Balanced;
+  uint64_t micros_per_flush_ = 1000000;
+  uint64_t max_compaction_files_ = 64;
+  // 0 rebalances inline, otherwise routes rebalanced after each flush.
+  uint64_t rebalance_routes_ = 0;
+  bool leaf_gap_moves_ = false;
+};
+
+// Key generators of the workloads, keys are in [0, n).
+struct KeyGenerator {
+  virtual ~KeyGenerator() {}
+  virtual uint64_t Next() = 0;
+};
+struct UniformGenerator : public KeyGenerator {
+  std::mt19937_64 rnd_;
+  uint64_t n_;
+  UniformGenerator(uint64_t n, uint64_t seed) : rnd_(seed), n_(n) {}
+  virtual uint64_t Next() override { return rnd_() % n_; }
+};
+struct SequentialGenerator : public KeyGenerator {
+  uint64_t n_, curr_;
+  SequentialGenerator(uint64_t n) : n_(n), curr_(0) {}
+  virtual uint64_t Next() override { return curr_++ % n_; }
+};
+// Runs of block consecutive keys starting at random keys, like bulk 
+// loads of sorted batches. Runs landing between the leaves are moved 
+// down without rewrite, see SBSkiplist::IsTrivialMove().
+struct BulkGenerator : public KeyGenerator {
+  std::mt19937_64 rnd_;
+  uint64_t n_, block_, start_, i_;
+  BulkGenerator(uint64_t n, uint64_t block, uint64_t seed) 
+  : rnd_(seed), n_(n), block_(std::min(block, n)), start_(0), i_(block_) {}
+  virtual uint64_t Next() override {
+    if (i_ == block_) {
+      start_ = rnd_() % (n_ - block_ + 1);
+      i_ = 0;
+    }
+    return start_ + i_++;
+  }
+};
+// Zipfian over the keys with theta = 0.99, hot keys are scattered.
+struct ZipfianGenerator : public KeyGenerator {
+  std::mt19937_64 rnd_;
+  uint64_t n_;
+  double theta_, alpha_, zetan_, eta_;
+  ZipfianGenerator(uint64_t n, uint64_t seed)
+  : rnd_(seed), n_(n), theta_(0.99) {
+    zetan_ = 0;
+    for (uint64_t i = 1; i <= n_; ++i)
+      zetan_ += 1.0 / std::pow(i, theta_);
+    double zeta2 = 1 + 1.0 / std::pow(2, theta_);
+    alpha_ = 1.0 / (1 - theta_);
+    eta_ = (1 - std::pow(2.0 / n_, 1 - theta_)) / (1 - zeta2 / zetan_);
+  }
+  virtual uint64_t Next() override {
+    double u = std::uniform_real_distribution<double>(0, 1)(rnd_);
+    double uz = u * zetan_;
+    uint64_t rank;
+    if (uz < 1) rank = 0;
+    else if (uz < 1 + std::pow(0.5, theta_)) rank = 1;
+    else rank = n_ * std::pow(eta_ * u - eta_ + 1, alpha_);
+    if (rank >= n_) rank = n_ - 1;
+    return (rank * 0x9E3779B97F4A7C15ULL) % n_;
+  }
+};
+
+class Simulator {
+  SimOptions sim_;
+  ManualClock clock_;
+  SBSOptions options_;
+  SBSkiplist* list_;
+  Scorer* scorer_;
+  KeyGenerator* writes_;
+  KeyGenerator* reads_;
+  std::mt19937_64 rnd_;
+  uint64_t next_file_number_;
+  // keys of every live file.
+  std::map<uint64_t, std::vector<uint64_t>> contents_;
+  std::set<uint64_t> unique_;
+
+  uint64_t user_bytes_, flush_bytes_, compaction_bytes_, compactions_, trivial_moves_;
+  uint64_t lookups_, probes_;
+  std::vector<double> pick_micros_;
+  std::vector<double> put_micros_;
+
+  static std::string Key(uint64_t k) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%012" PRIu64, k);
+    return buf;
+  }
+  BFile* NewFile(std::vector<uint64_t>&& keys) {
+    auto f = new leveldb::FileMetaData();
+    f->number = next_file_number_++;
+    f->file_size = keys.size() * sim_.value_size_;
+    f->smallest = leveldb::InternalKey(Key(keys.front()), 0, leveldb::kTypeValue);
+    f->largest = leveldb::InternalKey(Key(keys.back()), 0, leveldb::kTypeValue);
+    contents_[f->number] = std::move(keys);
+    Statistics stats(options_, options_.NowTimeSlice());
+    return new BFile(f, stats);
+  }
+  uint64_t ScanLength() { return 1 + rnd_() % 100; }
+
+ public:
+  Simulator(const SimOptions& sim)
+  : sim_(sim), rnd_(301), next_file_number_(1),
+    user_bytes_(0), flush_bytes_(0), compaction_bytes_(0), compactions_(0), trivial_moves_(0),
+    lookups_(0), probes_(0) {
+    options_.SetClock(&clock_);
+    options_.max_compaction_files_ = sim_.max_compaction_files_;
+    options_.deferred_rebalance_ = sim_.rebalance_routes_ > 0;
+    options_.leaf_gap_moves_ = sim_.leaf_gap_moves_;
+    options_.SetScorerPolicy((CostModel::Policy)sim_.policy_);
+    list_ = new SBSkiplist(options_);
+    scorer_ = list_->NewScorer();
+    if (sim_.workload_ == "zipfian") {
+      writes_ = new ZipfianGenerator(sim_.keys_, 1);
+      reads_ = new ZipfianGenerator(sim_.keys_, 2);
+    } else if (sim_.workload_ == "bulk") {
+      writes_ = new BulkGenerator(sim_.keys_, sim_.keys_per_flush_ / 2, 1);
+      reads_ = new UniformGenerator(sim_.keys_, 2);
+    } else if (sim_.workload_ == "sequential") {
+      writes_ = new SequentialGenerator(sim_.keys_);
+      reads_ = new UniformGenerator(sim_.keys_, 2);
+    } else {
+      writes_ = new UniformGenerator(sim_.keys_, 1);
+      reads_ = new UniformGenerator(sim_.keys_, 2);
+    }
+  }
+  ~Simulator() {
+    delete scorer_;
+    delete list_;
+    delete writes_;
+    delete reads_;
+  }
+
+  void Flush() {
+    clock_.Advance(sim_.micros_per_flush_);
+    std::set<uint64_t> batch;
+    for (uint64_t i = 0; i < sim_.keys_per_flush_; ++i)
+      batch.insert(writes_->Next());
+    unique_.insert(batch.begin(), batch.end());
+    user_bytes_ += sim_.keys_per_flush_ * sim_.value_size_;
+    BFile* file = NewFile(std::vector<uint64_t>(batch.begin(), batch.end()));
+    flush_bytes_ += file->Data()->file_size;
+    auto start = std::chrono::steady_clock::now();
+    list_->Put(file);
+    auto end = std::chrono::steady_clock::now();
+    put_micros_.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    int64_t now = options_.NowTimeSlice();
+    list_->UpdateStatistics(*file, KSPutCount, batch.size(), now);
+    list_->UpdateStatistics(*file, KSBytesCount, file->Data()->file_size, now);
+  }
+
+  // Files a get of key probes, without bloom filters.
+  void Read() {
+    uint64_t k = reads_->Next();
+    std::string key = Key(k);
+    BFileVec files;
+    list_->LookupKey(key, files);
+    int64_t now = options_.NowTimeSlice();
+    for (BFile* file : files) {
+      probes_ ++;
+      auto& keys = contents_[file->Identifier()];
+      if (std::binary_search(keys.begin(), keys.end(), k)) {
+        list_->UpdateStatistics(*file, KSGetCount, 1, now);
+        break;
+      }
+    }
+    lookups_ ++;
+  }
+  // A scan merges every run on the route of its first key.
+  void Scan() {
+    std::string key = Key(reads_->Next());
+    BFileVec files;
+    list_->LookupKey(key, files);
+    int64_t now = options_.NowTimeSlice();
+    probes_ += files.size() * (1 + ScanLength() * sim_.value_size_ / options_.PageConst);
+    for (BFile* file : files)
+      list_->UpdateStatistics(*file, KSIterateCount, 1, now);
+    lookups_ ++;
+  }
+
+  // Pick and run one compaction, return false if nothing to do.
+  bool Compact() {
+    auto start = std::chrono::steady_clock::now();
+    double score = 0;
+    SBSIterator* iter = list_->NewScoreIterator(*scorer_, options_.NeedsCompactionScore(), score);
+    BFileVec containers[4];
+    if (iter)
+      list_->PickCompactionFilesByIterator(options_, iter, containers);
+    auto end = std::chrono::steady_clock::now();
+    pick_micros_.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    if (!iter) return false;
+    Coordinates coord = iter->Current();
+    delete iter;
+
+    BFileEdit edit;
+    if (list_->IsTrivialMove(coord, containers)) {
+      edit.Move(containers[0].GetOne()->Data());
+      SubSBS* sub = list_->LookupTree(edit);
+      sub->Build(edit);
+      delete sub;
+      if (coord.node_->Height() > coord.height_)
+        list_->CheckSplit(coord);
+      trivial_moves_ ++;
+      return true;
+    }
+    std::set<uint64_t> merged;
+    for (size_t i = 0; i < 2; ++i)
+      for (BFile* file : containers[i]) {
+        edit.Del(file->Data());
+        auto& keys = contents_[file->Identifier()];
+        merged.insert(keys.begin(), keys.end());
+      }
+    if (merged.empty()) return false;
+
+    // outputs are cut at guards and at the maximum file size.
+    std::set<uint64_t> cuts;
+    for (BFile* guard : containers[2])
+      cuts.insert(std::strtoull(guard->Min().ToString().c_str(), nullptr, 10));
+    uint64_t keys_per_file = options_.MaxFileSize() / sim_.value_size_;
+    std::vector<uint64_t> output;
+    std::vector<BFile*> outputs;
+    auto cut = cuts.begin();
+    for (uint64_t k : merged) {
+      bool at_guard = false;
+      while (cut != cuts.end() && *cut <= k) { at_guard = true; ++cut; }
+      if (!output.empty() && (at_guard || output.size() >= keys_per_file)) {
+        outputs.push_back(NewFile(std::move(output)));
+        output.clear();
+      }
+      output.push_back(k);
+    }
+    outputs.push_back(NewFile(std::move(output)));
+    for (BFile* file : outputs) {
+      edit.Add(file->Data());
+      compaction_bytes_ += file->Data()->file_size;
+    }
+
+    SubSBS* sub = list_->LookupTree(edit);
+    sub->Build(edit);
+    for (auto f : edit.deleted_)
+      contents_.erase(f->number);
+    if (coord.node_->Height() > coord.height_) {
+      list_->CheckSplit(coord);
+    }
+    delete sub;
+    // Build() keeps FileMetaData, not the BFile wrappers made here.
+    for (BFile* file : outputs) delete file;
+    compactions_ ++;
+    return true;
+  }
+
+  void Run() {
+    for (uint64_t i = 0; i < sim_.flushes_; ++i) {
+      Flush();
+      if (sim_.rebalance_routes_)
+        list_->Rebalance(sim_.rebalance_routes_);
+      for (size_t c = 0; c < 64 && Compact(); ++c);
+      for (uint64_t r = 0; r < sim_.reads_per_flush_; ++r)
+        if (sim_.workload_ == "scan") Scan(); else Read();
+    }
+  }
+
+  void Report() const {
+    uint64_t live = 0;
+    for (auto& p : contents_) live += p.second.size() * sim_.value_size_;
+    uint64_t unique = unique_.size() * sim_.value_size_;
+    std::vector<double> picks(pick_micros_), puts(put_micros_);
+    std::sort(picks.begin(), picks.end());
+    std::sort(puts.begin(), puts.end());
+    double sum = 0, put_sum = 0;
+    for (double p : picks) sum += p;
+    for (double p : puts) put_sum += p;
+    auto pct = [&](double q) {
+      return picks.empty() ? 0 : picks[std::min(picks.size() - 1, (size_t)(q * picks.size()))];
+    };
+    printf("workload          %s\n", sim_.workload_.c_str());
+    printf("flushes           %" PRIu64 "\n", sim_.flushes_);
+    printf("compactions       %" PRIu64 "\n", compactions_);
+    printf("trivial_moves     %" PRIu64 "\n", trivial_moves_);
+    printf("write_amp         %.3f\n", 1.0 * (flush_bytes_ + compaction_bytes_) / user_bytes_);
+    printf("read_amp          %.3f\n", lookups_ ? 1.0 * probes_ / lookups_ : 0);
+    printf("space_amp         %.3f\n", unique ? 1.0 * live / unique : 0);
+    SBSkiplist::CompactionDebt debt;
+    list_->EstimateCompactionDebt(debt);
+    printf("pending_write_mb  %.1f\n", debt.WriteBytes() / 1048576.0);
+    printf("pick_avg_us       %.1f\n", picks.empty() ? 0 : sum / picks.size());
+    printf("pick_p99_us       %.1f\n", pct(0.99));
+    printf("pick_max_us       %.1f\n", picks.empty() ? 0 : picks.back());
+    printf("put_avg_us        %.1f\n", puts.empty() ? 0 : put_sum / puts.size());
+    printf("put_max_us        %.1f\n", puts.empty() ? 0 : puts.back());
+    printf("unbalanced_routes %zu\n", list_->UnbalancedRoutes());
+  }
+};
+
+}
+
+int main(int argc, char** argv) {
+  sagitrs::SimOptions sim;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    char buf[64];
+    unsigned long long n;
+    if (sscanf(arg, "--workload=%63s", buf) == 1) sim.workload_ = buf;
+    else if (sscanf(arg, "--keys=%llu", &n) == 1) sim.keys_ = n;
+    else if (sscanf(arg, "--flushes=%llu", &n) == 1) sim.flushes_ = n;
+    else if (sscanf(arg, "--keys_per_flush=%llu", &n) == 1) sim.keys_per_flush_ = n;
+    else if (sscanf(arg, "--value_size=%llu", &n) == 1) sim.value_size_ = n;
+    else if (sscanf(arg, "--reads_per_flush=%llu", &n) == 1) sim.reads_per_flush_ = n;
+    else if (sscanf(arg, "--policy=%llu", &n) == 1) sim.policy_ = n;
+    else if (sscanf(arg, "--micros_per_flush=%llu", &n) == 1) sim.micros_per_flush_ = n;
+    else if (sscanf(arg, "--max_compaction_files=%llu", &n) == 1) sim.max_compaction_files_ = n;
+    else if (sscanf(arg, "--rebalance_routes=%llu", &n) == 1) sim.rebalance_routes_ = n;
+    else if (sscanf(arg, "--leaf_gap_moves=%llu", &n) == 1) sim.leaf_gap_moves_ = n;
+    else {
+      fprintf(stderr, "Invalid flag '%s'\n", arg);
+      return 1;
+    }
+  }
+  sagitrs::Simulator simulator(sim);
+  simulator.Run();
+  simulator.Report();
+  return 0;
+}
@@ -2,8 +2,11 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <thread>
+#include <random>
 #include "gtest/gtest.h"
 #include "sbs.h"
+#include "write_controller.h"
 #include "bfile.h"
 #include "bounded.h"
 #include "bounded_value_container.h"
@@ -68,6 +71,758 @@ TEST(SBSTest, Simple) {
   std::cout << list.ToString() << std::endl;
 }
 
+TEST(SBSTest, DecayedStatistics) {
+  sagitrs::SBSOptions options;
+  options.SetStatisticsBackend(StatisticsOptions::DecayedAverage);
+  options.SetHalfLifeTimeSlice(1);
+  Statistics a(options, 10), b(options, 10);
+  a.UpdateStatistics(KSGetCount, 100, 10);
+  b.UpdateStatistics(KSGetCount, 100, 10);
+  b.UpdateStatistics(KSGetCount, 40, 11);
+  // slice 10 is folded into the average with weight 1/2.
+  ASSERT_EQ(b.GetStatistics(KSGetCount, 10), 50);
+  ASSERT_EQ(b.GetStatistics(KSGetCount, 11), 45);
+  a.MergeStatistics(b);
+  ASSERT_EQ(a.GetStatistics(KSGetCount, 10), 100);
+  ASSERT_EQ(a.GetStatistics(KSGetCount, 11), 70);
+  ASSERT_EQ(a.GetStatistics(KSGetCount, STATISTICS_ALL), 240);
+  // no slices are kept, the record has a fixed size.
+  Statistics c(sagitrs::SBSOptions(), 10);
+  ASSERT_EQ(a.MemoryUsage(), sizeof(Statistics) + sizeof(DecayCounter));
+  ASSERT_LT(a.MemoryUsage(), c.MemoryUsage());
+}
+
+TEST(SBSTest, HotRanges) {
+  HotRanges hot;
+  hot.Reset(2, 0);
+  BFile *a = BuildFile(10, 19), *b = BuildFile(20, 29), *c = BuildFile(30, 39);
+  hot.Offer(*a, 5);
+  hot.Offer(*b, 3);
+  hot.Offer(*c, 4);
+  ASSERT_EQ(hot.size(), 2);
+  ASSERT_EQ(hot.Hottest()->id_, a->Identifier());
+  ASSERT_EQ(hot[1].id_, c->Identifier());
+  hot.Offer(*c, 6);
+  ASSERT_EQ(hot.Hottest()->id_, c->Identifier());
+  hot.Remove(c->Identifier());
+  ASSERT_EQ(hot.Hottest()->id_, a->Identifier());
+  // files may be deleted while they are remembered.
+  uint64_t id = a->Identifier();
+  delete a; 
+  hot.Offer(*b, 7);
+  ASSERT_EQ(hot.Hottest()->id_, b->Identifier());
+  ASSERT_EQ(hot[1].id_, id);
+  ASSERT_EQ(hot[1].Min().ToString(), "10");
+  delete b; delete c;
+}
+
+TEST(SBSTest, MetricsFormat) {
+  sagitrs::SBSOptions options;
+  LevelNode::VariableTable table(options);
+  table[HoleFileSize] = 123456789;
+  MetricsCollector collector(true);
+  collector.Reset();
+  collector.AddNode("k", 1, table);
+  collector.AddGlobal("ratio", 0.125);
+  collector.Finish();
+  std::stringstream prom, json;
+  collector.PrintPrometheus(prom);
+  collector.PrintJSON(json);
+  ASSERT_NE(prom.str().find("sbs_hole_file_bytes{height=\"1\",guard=\"k\"} 123456789\n"), std::string::npos);
+  ASSERT_NE(prom.str().find("sbs_height_hole_file_bytes{height=\"1\"} 123456789\n"), std::string::npos);
+  ASSERT_NE(prom.str().find("sbs_ratio 0.125\n"), std::string::npos);
+  ASSERT_NE(json.str().find("{\"name\":\"hole_file_bytes\",\"height\":1,\"guard\":\"k\",\"value\":123456789}"), std::string::npos);
+  // unchanged nodes are skipped, missing ones are forgotten.
+  auto per_node = [&]() {
+    size_t count = 0;
+    for (auto& sample : collector.Samples()) count += sample.per_node_;
+    return count;
+  };
+  collector.Reset();
+  collector.AddNode("k", 1, table);
+  collector.Finish();
+  ASSERT_EQ(per_node(), 0);
+  collector.Reset();
+  collector.Finish();
+  collector.Reset();
+  collector.AddNode("k", 1, table);
+  collector.Finish();
+  ASSERT_EQ(per_node(), MetricsCollector::Gauges().size());
+}
+
+TEST(SBSTest, SamplerTable) {
+  SamplerTable table;
+  table.Add("b", 2);
+  table.Add("abcdefghij", 3);
+  table.Add("abcdefghik", 5);
+  table.Add("d", 1);
+  table.StopSampling();
+  ASSERT_EQ(table.GetCountSmallerOrEqualThan("a"), 0);
+  ASSERT_EQ(table.GetCountSmallerOrEqualThan("abcdefghij"), 3);
+  ASSERT_EQ(table.GetCountSmallerOrEqualThan("abcdefghijz"), 3);
+  ASSERT_EQ(table.GetCountSmallerOrEqualThan("abcdefghik"), 8);
+  ASSERT_EQ(table.GetCountSmallerOrEqualThan("c"), 10);
+  ASSERT_EQ(table.GetCountSmallerOrEqualThan("z"), 11);
+}
+
+TEST(SBSTest, SamplerThreads) {
+  Sampler sampler;
+  // keys share a prefix longer than any fixed key buffer.
+  std::string prefix(40, 'u');
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; ++t)
+    threads.emplace_back([&]() {
+      for (size_t i = 0; i < 1000; ++i) {
+        sampler.WriteSample(prefix + std::to_string(1000 + i % 100), 50);
+        sampler.ReadSample(prefix);
+      }
+    });
+  for (auto& t : threads) t.join();
+  SamplerTable& table = sampler.WriteTable();
+  ASSERT_EQ(table.TotalCount(), 4000);
+  ASSERT_EQ(sampler.ReadTable().TotalCount(), 4000);
+  ASSERT_EQ(sampler.WriteBytesTable().TotalCount(), 4000 * (prefix.size() + 4 + 50 + 10));
+  table.StopSampling();
+  ASSERT_EQ(table.GetCountSmallerOrEqualThan(prefix + "1049"), 2000);
+}
+
+TEST(SBSTest, BoundedSamplerTable) {
+  SamplerTable table(64);
+  for (size_t i = 0; i < 10000; ++i)
+    table.Add(std::to_string(10000 + i * 7919 % 10000));
+  ASSERT_LE(table.size(), 64);
+  table.StopSampling();
+  ASSERT_EQ(table.TotalCount(), 10000);
+  size_t error = table.RankError() * table.TotalCount();
+  ASSERT_LE(error, table.TotalCount() / 10);
+  for (size_t k = 10000; k < 20000; k += 999) {
+    size_t count = table.GetCountSmallerOrEqualThan(std::to_string(k));
+    ASSERT_LE(count, k - 10000 + 1);
+    ASSERT_GE(count + error, k - 10000 + 1);
+  }
+}
+
+TEST(SBSTest, IndexedScore) {
+  sagitrs::SBSOptions options;
+  ManualClock clock;
+  options.SetClock(&clock);
+  std::mt19937 rnd(301);
+  std::vector<BFile*> files, popped;
+  {
+    sagitrs::SBSkiplist list(options);
+    Scorer* scorer = list.NewScorer();
+    std::set<uint64_t> ids;
+    for (size_t i = 0; i < 3000; ++i) {
+      if (files.size() < 100 || rnd() % 3 > 0) {
+        size_t a = 1000 + rnd() % 9000;
+        size_t b = rnd() % 4 ? a : std::min<size_t>(a + rnd() % 400, 9999);
+        if (!ids.insert(a * 100 + b).second) continue;
+        files.push_back(BuildFile(a, b));
+        list.Put(files.back());
+      } else {
+        size_t k = rnd() % files.size();
+        ASSERT_EQ(list.Pop(*files[k]), files[k]);
+        popped.push_back(files[k]);
+        files.erase(files.begin() + k);
+      }
+      if (i % 10) continue;
+      double indexed = 0;
+      delete list.NewScoreIterator(*scorer, 0, indexed);
+      SBSIterator iter(list.GetHead());
+      iter.UpdateAllTable();
+      ASSERT_DOUBLE_EQ(indexed, iter.SeekScore(*scorer, 0, true)) << i;
+    }
+    delete scorer;
+  }
+  // popped files may still be guards until the tree is gone.
+  for (auto file : popped) delete file;
+}
+
+TEST(SBSTest, ParallelUpdateTable) {
+  sagitrs::SBSOptions options;
+  ManualClock clock;
+  clock.Advance(options.NowMicros());
+  options.SetClock(&clock);
+  options.parallel_update_min_leaves_ = 0;
+  std::mt19937 rnd(301);
+  sagitrs::SBSkiplist list(options);
+  std::vector<BFile*> files;
+  for (size_t a = 1000; a < 5000; ++a) {
+    size_t b = a % 7 ? a : a + rnd() % 40;
+    files.push_back(BuildFile(a, b));
+    list.Put(files.back());
+  }
+  for (BFile* file : files) {
+    size_t puts = 1 + rnd() % 100;
+    list.UpdateStatistics(*file, KSPutCount, puts, options.NowTimeSlice());
+    list.UpdateStatistics(*file, KSBytesCount, puts * 100, options.NowTimeSlice());
+    list.UpdateStatistics(*file, KSGetCount, rnd() % 100, options.NowTimeSlice());
+  }
+  clock.Advance(options.TimeSliceMicroSecond());
+  list.FlushStatistics();
+  std::vector<uint64_t> tables[2];
+  for (size_t k = 0; k < 2; ++k) {
+    SBSIterator iter(list.GetHead());
+    iter.UpdateAllTable(k == 0 ? 1 : 4);
+    SBSNode* head = list.GetHead();
+    ASSERT_GE(head->Height(), 3);
+    for (size_t h = 1; h < head->Height(); ++h)
+      for (SBSNode* node = head; node != nullptr; node = node->Next(h)) {
+        auto& table = node->GetLevel(h)->table_;
+        tables[k].insert(tables[k].end(), table.begin(), table.end());
+      }
+  }
+  ASSERT_EQ(tables[0], tables[1]);
+}
+
+TEST(SBSTest, PickCompactions) {
+  sagitrs::SBSOptions options;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 1000; a < 5000; ++a)
+    list.Put(BuildFile(a, a % 50 ? a : a + 10));
+  // reserved level nodes and files in the tree.
+  auto marks = [&](std::set<uint64_t>& files) {
+    size_t lnodes = 0;
+    for (SBSNode* node = list.GetHead(); node != nullptr; node = node->Next(0))
+      for (size_t h = 0; h < node->Height(); ++h) {
+        lnodes += node->GetLevel(h)->reserved_;
+        for (BFile* file : node->GetLevel(h)->buffer_)
+          if (file->Reserved()) files.insert(file->Identifier());
+      }
+    return lnodes;
+  };
+  Scorer* scorer = list.NewScorer();
+  std::vector<SBSkiplist::CompactionJob*> jobs;
+  // a baseline below 0 takes every node with a buffer.
+  ASSERT_EQ(list.PickCompactions(*scorer, -1, 4, jobs), 4);
+  std::set<uint64_t> inputs;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    for (size_t j = 0; j < i; ++j)
+      ASSERT_FALSE(jobs[i]->region_.Overlap(jobs[j]->region_));
+    if (i > 0) inputs.insert(jobs[i]->region_.files_.begin(), jobs[i]->region_.files_.end());
+  }
+  // install the first job as one output file over its inputs.
+  BFileEdit edit;
+  std::string lo, hi;
+  for (size_t i = 0; i < 2; ++i)
+    for (BFile* file : jobs[0]->containers_[i]) {
+      ASSERT_TRUE(file->Reserved());
+      edit.Del(file->Data());
+      if (lo.empty() || file->Min().compare(lo) < 0) lo = file->Min().ToString();
+      if (hi.empty() || file->Max().compare(hi) > 0) hi = file->Max().ToString();
+    }
+  BFile* output = BuildFile(std::stoul(lo), std::stoul(hi));
+  // a new number, the range may be the same as an input's.
+  output->Data()->number = 1;
+  edit.Add(output->Data());
+  SubSBS* sub = list.LookupTree(edit);
+  ASSERT_TRUE(sub->Build(edit));
+  delete sub;
+  delete output;
+  FileIndex::Entry entry;
+  ASSERT_TRUE(list.LocateFile(1, entry));
+  std::set<uint64_t> reserved;
+  ASSERT_EQ(marks(reserved), jobs.size() - 1);
+  ASSERT_EQ(reserved, inputs);
+  for (size_t i = 1; i < jobs.size(); ++i)
+    ASSERT_TRUE(list.Reserved(jobs[i]->coord_));
+  // new picks keep clear of the running ones.
+  std::vector<SBSkiplist::CompactionJob*> more;
+  ASSERT_EQ(list.PickCompactions(*scorer, -1, 4, more), 4);
+  for (auto job : more)
+    for (size_t i = 1; i < jobs.size(); ++i)
+      ASSERT_FALSE(job->region_.Overlap(jobs[i]->region_));
+  for (auto job : more) {
+    list.ReleaseCompaction(job);
+    delete job;
+  }
+  for (size_t i = 1; i < jobs.size(); ++i)
+    list.ReleaseCompaction(jobs[i]);
+  reserved.clear();
+  ASSERT_EQ(marks(reserved), 0);
+  ASSERT_TRUE(reserved.empty());
+  ASSERT_FALSE(list.Reserved(Coordinates(list.GetHead(), list.GetHead()->Height() - 1)));
+  for (auto job : jobs) delete job;
+  delete scorer;
+}
+
+TEST(SBSTest, PlanSubcompactions) {
+  sagitrs::SBSOptions options;
+  options.max_subcompactions_ = 3;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 1000; a < 5000; ++a)
+    list.Put(BuildFile(a, a));
+  SBSNode* head = list.GetHead();
+  Coordinates parent(head, head->Height() - 2);
+  BFileVec guards;
+  for (Coordinates c = parent.DownNode(); c.node_ != parent.Next(); c.JumpNext())
+    if (c.node_ != head)
+      guards.push_back(c.node_->Pacesetter());
+  ASSERT_GT(guards.size(), 2);
+  std::vector<SBSkiplist::Subcompaction> plan;
+  list.PlanSubcompactions(options, parent, guards, plan);
+  ASSERT_GT(plan.size(), 1);
+  ASSERT_LE(plan.size(), 3);
+  ASSERT_EQ(plan.front().begin_, nullptr);
+  ASSERT_EQ(plan.back().end_, nullptr);
+  for (size_t i = 0; i + 1 < plan.size(); ++i)
+    ASSERT_EQ(plan[i].end_, plan[i + 1].begin_);
+  // every key falls in one subcompaction, every guard cuts or splits one.
+  for (size_t a = 1000; a < 5000; ++a) {
+    size_t covers = 0;
+    for (auto& sub : plan) 
+      covers += sub.Contains(std::to_string(a));
+    ASSERT_EQ(covers, 1);
+  }
+  for (BFile* guard : guards) {
+    size_t uses = 0;
+    for (auto& sub : plan) {
+      uses += sub.begin_ == guard;
+      for (BFile* g : sub.guards_)
+        uses += g == guard;
+    }
+    ASSERT_EQ(uses, 1);
+  }
+  // a table still sampling is not read, every child counts the same.
+  SamplerTable table;
+  table.Add("1000");
+  sagitrs::SBSOptions sampling(options);
+  sampling.table_ = &table;
+  std::vector<SBSkiplist::Subcompaction> unsampled;
+  list.PlanSubcompactions(sampling, parent, guards, unsampled);
+  ASSERT_EQ(unsampled.size(), plan.size());
+  // an input shared by two subcompactions is deleted once.
+  BFile *a = BuildFile(1, 1), *b = BuildFile(2, 2), *c = BuildFile(3, 3);
+  BFile *x = BuildFile(4, 4), *y = BuildFile(5, 5);
+  BFileEdit e1, e2, edit;
+  e1.Del(a->Data());
+  e1.Del(b->Data());
+  e1.Add(x->Data());
+  e2.Del(b->Data());
+  e2.Del(c->Data());
+  e2.Add(y->Data());
+  edit.Merge(e1);
+  edit.Merge(e2);
+  ASSERT_EQ(edit.deleted_.size(), 3);
+  ASSERT_EQ(edit.generated_.size(), 2);
+  for (BFile* file : {a, b, c, x, y}) delete file;
+}
+
+TEST(SBSTest, CostCalibrator) {
+  CostCalibrator calibrator(0.5, 4, 4, 64 << 20);
+  CostModel base;
+  calibrator.RecordCompaction(16 << 20, 1000000);
+  ASSERT_EQ(calibrator.Calibrate(base).alpha_, base.alpha_);
+  for (size_t i = 0; i < 16; ++i) {
+    calibrator.RecordCompaction(32 << 20, 1000000);
+    calibrator.RecordGet(10, 5);
+  }
+  CostModel model = calibrator.Calibrate(base);
+  ASSERT_NEAR(model.alpha_, base.alpha_ * 2, 0.01);
+  ASSERT_EQ(model.bloom_fp_, base.bloom_fp_ * 4);
+  ASSERT_EQ(model.page_size_, base.page_size_);
+}
+
+TEST(SBSTest, ManualClock) {
+  sagitrs::SBSOptions options;
+  ManualClock clock;
+  options.SetClock(&clock);
+  Statistics stats(options, options.NowTimeSlice());
+  ASSERT_EQ(options.NowTimeSlice(), 0);
+  stats.UpdateStatistics(KSGetCount, 10, options.NowTimeSlice());
+  clock.Advance(options.TimeSliceMicroSecond() * 3);
+  ASSERT_EQ(options.NowTimeSlice(), 3);
+  stats.UpdateStatistics(KSGetCount, 20, options.NowTimeSlice());
+  ASSERT_EQ(stats.GetStatistics(KSGetCount, 0), 10);
+  ASSERT_EQ(stats.GetStatistics(KSGetCount, 3), 20);
+}
+
+TEST(SBSTest, TrivialMove) {
+  sagitrs::SBSOptions options;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 100; a < 1000; ++a)
+    list.Put(BuildFile(a * 10, a * 10 + 1));
+  list.Put(BuildFile(5000, 6000));
+  Scorer* scorer = list.NewScorer();
+  std::vector<SBSkiplist::CompactionJob*> jobs;
+  ASSERT_EQ(list.PickCompactions(*scorer, -1, 1, jobs), 1);
+  ASSERT_GT(jobs[0]->coord_.height_, 1);
+  // its output falls between the leaves 5010 and 5020, in level 1.
+  BFileEdit edit;
+  edit.Del(jobs[0]->containers_[0].GetOne()->Data());
+  BFile* output = BuildFile(5013, 5015);
+  output->Data()->number = 1;
+  output->Data()->file_size = options.MaxFileSize();
+  edit.Add(output->Data());
+  SubSBS* sub = list.LookupTree(edit);
+  ASSERT_TRUE(sub->Build(edit));
+  delete sub;
+  delete output;
+  delete jobs[0];
+  jobs.clear();
+  FileIndex::Entry entry;
+  ASSERT_TRUE(list.LocateFile(1, entry));
+  ASSERT_EQ(entry.height_, 1);
+  BFile* file = entry.file_;
+  list.UpdateStatistics(*file, KSGetCount, 7, options.NowTimeSlice());
+
+  ASSERT_EQ(list.PickCompactions(*scorer, -1, 1, jobs), 1);
+  SBSkiplist::CompactionJob* job = jobs[0];
+  ASSERT_EQ(job->coord_.height_, 1);
+  ASSERT_EQ(job->containers_[0].GetOne(), file);
+  ASSERT_TRUE(list.IsTrivialMove(job->coord_, job->containers_));
+  ASSERT_TRUE(file->Reserved());
+  BFileEdit move;
+  move.Move(file->Data());
+  sub = list.LookupTree(move);
+  ASSERT_TRUE(sub->Build(move));
+  delete sub;
+  // a new leaf holding the same BFile.
+  ASSERT_TRUE(list.LocateFile(1, entry));
+  ASSERT_EQ(entry.height_, 0);
+  ASSERT_EQ(entry.file_, file);
+  ASSERT_EQ(entry.node_->Guard().ToString(), "5013");
+  BFileVec route;
+  list.LookupKey("5014", route);
+  ASSERT_EQ(route.size(), 1);
+  ASSERT_EQ(file->GetStatistics(KSGetCount, STATISTICS_ALL), 7);
+  ASSERT_FALSE(file->Reserved());
+  for (SBSNode* node = list.GetHead(); node != nullptr; node = node->Next(0))
+    for (size_t h = 0; h < node->Height(); ++h)
+      ASSERT_FALSE(node->GetLevel(h)->reserved_);
+  ASSERT_FALSE(list.Reserved(job->coord_));
+  delete job;
+  delete scorer;
+}
+
+TEST(SBSTest, WriteController) {
+  sagitrs::SBSOptions options;
+  ManualClock clock(1000000);
+  options.SetClock(&clock);
+  WriteController controller(options);
+  controller.Update(1.0, 0, 0, 0);
+  ASSERT_EQ(controller.Delay(1 << 20), 0);
+  controller.Update(1.90, 0, 0, 0);
+  ASSERT_NEAR(controller.Pressure(), 0.5, 1e-6);
+  ASSERT_NEAR(controller.Rate(), 16 << 20, 1);
+  // one second of writes at the limited rate.
+  ASSERT_NEAR(controller.Delay(16 << 20), 1000000, 1);
+  clock.Advance(1000000);
+  ASSERT_NEAR(controller.Delay(16 << 20), 1000000, 1);
+  controller.Update(1.0, 0, 0, 16ULL << 30);
+  ASSERT_NEAR(controller.Rate(), 1 << 20, 1);
+}
+
+TEST(SBSTest, CompactionDebt) {
+  sagitrs::SBSOptions options;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 100; a < 1000; ++a)
+    list.Put(BuildFile(a * 10, a * 10 + 1));
+  for (size_t i = 0; i < options.Level0CompactionSize(); ++i) {
+    BFile* file = BuildFile(1000 + i, 9991 - i);
+    file->Data()->file_size = 1 << 20;
+    list.Put(file);
+  }
+  SBSNode* head = list.GetHead();
+  size_t level0 = list.Level0Height();
+  ASSERT_GT(level0, 1);
+  ASSERT_EQ(head->Next(level0), nullptr);
+  ASSERT_EQ(head->GetLevel(level0)->buffer_.size(), options.Level0CompactionSize());
+  SBSIterator iter(head);
+  iter.UpdateAllTable();
+  // room for all runs, only the level 0 rule makes the files a debt.
+  head->GetLevel(level0)->table_[HoleFileCapacity] = 1 << 20;
+  SBSkiplist::CompactionDebt debt;
+  list.EstimateCompactionDebt(debt);
+  // read and written in level 0, then once more in every height below.
+  uint64_t bytes = options.Level0CompactionSize() << 20;
+  for (size_t h = 1; h <= level0; ++h) {
+    ASSERT_EQ(debt.read_bytes_[h], bytes);
+    ASSERT_EQ(debt.write_bytes_[h], bytes);
+  }
+  ASSERT_EQ(debt.ReadBytes(), bytes * level0);
+}
+
+TEST(SBSTest, ReadSeekScore) {
+  sagitrs::SBSOptions options;
+  ManualClock clock;
+  clock.Advance(options.NowMicros());
+  options.SetClock(&clock);
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 100; a < 1000; ++a)
+    list.Put(BuildFile(a * 10, a * 10 + 1));
+  SBSIterator iter(list.GetHead());
+  iter.SeekRange(SliceBounded("5000", "5001"), true);
+  ASSERT_EQ(iter.Current().height_, 1);
+  SBSNode* node = iter.Current().node_;
+  std::string hi;
+  for (SBSNode* n = node; n != node->Next(1); n = n->Next(0))
+    hi = n->GetLevel(0)->buffer_.GetOne()->Max().ToString();
+  // two files over all the leaves of node, a get wastes one probe.
+  BFile* files[2];
+  for (size_t i = 0; i < 2; ++i) {
+    files[i] = BuildFile(std::stoul(node->Guard().ToString()), std::stoul(hi));
+    files[i]->Data()->number = i + 1;
+    files[i]->Data()->file_size = 60 * options.SeekCompactionBytes();
+    list.Put(files[i]);
+    FileIndex::Entry entry;
+    ASSERT_TRUE(list.LocateFile(files[i]->Identifier(), entry));
+    ASSERT_EQ(entry.node_, node);
+  }
+  auto score = [&]() {
+    list.FlushStatistics();
+    SBSIterator iter(list.GetHead());
+    iter.UpdateAllTable();
+    return node->GetLevel(1)->table_[ReadSeekScore];
+  };
+  int64_t now = options.NowTimeSlice();
+  list.UpdateStatistics(*files[0], KSGetCount, 9, now);
+  clock.Advance(options.TimeSliceMicroSecond());
+  // 108 gets a minute waste less than the 120 probes worth compacting the
+  // files, 120 gets cross SeekCompactionBytes().
+  ASSERT_EQ(score(), 90);
+  list.UpdateStatistics(*files[0], KSGetCount, 1, now);
+  ASSERT_EQ(score(), 100);
+}
+
+TEST(SBSTest, TombstoneDensity) {
+  sagitrs::SBSOptions options;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 100; a < 1000; ++a)
+    list.Put(BuildFile(a * 10, a * 10 + 1));
+  // 1000 keys of 100 bytes over a leaf, in level 1.
+  BFile* file = BuildFile(5001, 5001);
+  file->Data()->number = 1;
+  file->Data()->file_size = 100 * 1000;
+  list.Put(file);
+  FileIndex::Entry entry;
+  ASSERT_TRUE(list.LocateFile(1, entry));
+  ASSERT_EQ(entry.height_, 1);
+  int64_t now = options.NowTimeSlice();
+  list.UpdateStatistics(*file, KSPutCount, 1000, now);
+  list.UpdateStatistics(*file, KSBytesCount, 100 * 1000, now);
+  auto density = [&]() {
+    list.FlushStatistics();
+    SBSIterator iter(list.GetHead());
+    iter.UpdateAllTable();
+    return entry.node_->GetLevel(1)->table_[TombstoneDensity];
+  };
+  Scorer* scorer = list.NewScorer();
+  list.UpdateStatistics(*file, KSDeleteCount, 499, now);
+  ASSERT_LT(density(), 1000 * options.TombstoneCompactionDensity());
+  ASSERT_LT(scorer->GetScore(entry.node_, 1), 1);
+  list.UpdateStatistics(*file, KSDeleteCount, 1, now);
+  ASSERT_EQ(density(), 1000 * options.TombstoneCompactionDensity());
+  ASSERT_GE(scorer->GetScore(entry.node_, 1), 1);
+  // the deletions of a file being compacted are not pending work.
+  file->SetReserved(true);
+  ASSERT_EQ(density(), 0);
+  file->SetReserved(false);
+  delete scorer;
+}
+
+TEST(SBSTest, PartialCompaction) {
+  sagitrs::SBSOptions options;
+  options.max_compaction_files_ = 4;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 100; a < 1000; ++a)
+    list.Put(BuildFile(a * 10, a * 10 + 1));
+  SBSIterator iter(list.GetHead());
+  iter.SeekRange(SliceBounded("5000", "5001"), true);
+  ASSERT_EQ(iter.Current().height_, 1);
+  SBSNode* node = iter.Current().node_;
+  // two files over each leaf of node, more than the limit.
+  std::vector<BFile*> files;
+  for (SBSNode* n = node; n != node->Next(1); n = n->Next(0)) {
+    size_t g = std::stoul(n->Guard().ToString());
+    for (size_t k = 0; k < 2; ++k) {
+      files.push_back(BuildFile(g, g + 1));
+      files.back()->Data()->number = files.size();
+      list.Put(files.back());
+    }
+  }
+  BFileVec& buffer = node->GetLevel(1)->buffer_;
+  ASSERT_EQ(buffer.size(), files.size());
+  ASSERT_GT(buffer.size(), options.MaxCompactionFiles());
+  // the leaves are rewritten too, the files over the smallest go first.
+  SBSNode* cheap = node->Next(0, 2);
+  for (SBSNode* n = node; n != node->Next(1); n = n->Next(0))
+    n->GetLevel(0)->buffer_.GetOne()->Data()->file_size = 
+      n == cheap ? 1 : options.MaxFileSize();
+
+  Scorer* scorer = list.NewScorer();
+  std::vector<SBSkiplist::CompactionJob*> jobs;
+  ASSERT_EQ(list.PickCompactions(*scorer, -1, 1, jobs), 1);
+  SBSkiplist::CompactionJob* job = jobs[0];
+  ASSERT_EQ(job->coord_.node_, node);
+  BFileVec& picked = job->containers_[0];
+  ASSERT_EQ(picked.size(), 2);
+  for (BFile* file : picked)
+    ASSERT_EQ(file->Compare(*cheap->GetLevel(0)->buffer_.GetOne()), BOverlap);
+  // a run of the buffer in Min order, no file left behind overlaps it.
+  std::vector<BFile*> sorted(buffer.begin(), buffer.end());
+  size_t st = 0;
+  while (!picked.Contains(sorted[st]->Identifier())) ++st;
+  RealBounded range(picked);
+  std::set<uint64_t> inputs;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    bool in = picked.Contains(sorted[i]->Identifier());
+    ASSERT_EQ(in, i >= st && i < st + picked.size());
+    if (in) inputs.insert(sorted[i]->Identifier());
+    else ASSERT_NE(range.Compare(*sorted[i]), BOverlap);
+  }
+
+  // install the job, the kept files stay in the buffer of node.
+  BFileEdit edit;
+  std::string lo, hi;
+  for (size_t i = 0; i < 2; ++i)
+    for (BFile* file : job->containers_[i]) {
+      edit.Del(file->Data());
+      if (lo.empty() || file->Min().compare(lo) < 0) lo = file->Min().ToString();
+      if (hi.empty() || file->Max().compare(hi) > 0) hi = file->Max().ToString();
+    }
+  BFile* output = BuildFile(std::stoul(lo), std::stoul(hi));
+  output->Data()->number = 1000;
+  edit.Add(output->Data());
+  SubSBS* sub = list.LookupTree(edit);
+  ASSERT_TRUE(sub->Build(edit));
+  delete sub;
+  delete output;
+  // the inputs are freed, the level node is rebuilt.
+  for (uint64_t number = 1; number <= files.size(); ++number) {
+    FileIndex::Entry entry;
+    bool found = list.LocateFile(number, entry);
+    ASSERT_EQ(found, inputs.count(number) == 0);
+    if (found) {
+      ASSERT_EQ(entry.node_, node);
+      ASSERT_EQ(entry.height_, 1);
+    }
+  }
+  ASSERT_EQ(node->GetLevel(1)->buffer_.size(), files.size() - inputs.size());
+  delete job;
+  delete scorer;
+}
+
+TEST(SBSTest, SplitAvoidsFiles) {
+  sagitrs::SBSOptions options;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 100; a < 1000; ++a)
+    list.Put(BuildFile(a * 10, a * 10 + 1));
+  FileIndex::Entry entry;
+  ASSERT_TRUE(list.LocateFile(5000 * 100 + 5001, entry));
+  SBSNode* node = entry.node_;
+  ASSERT_EQ(node->Width(1), 6);
+  // narrower widths leave 3 valid splits of this node.
+  sagitrs::SBSOptions narrow;
+  narrow.width_[0] = 2;
+  narrow.width_[1] = 4;
+  narrow.width_[2] = 8;
+  size_t reserve = node->Width(1) - narrow.DefaultWidth();
+  SBSNode* middle = node->Next(0, reserve);
+  ASSERT_EQ(node->ChooseSplit(narrow, 1, reserve), middle);
+  // a file over the middle guard moves the split off it.
+  BFile* file = BuildFile(5015, 5025);
+  file->Data()->number = 1;
+  list.Put(file);
+  ASSERT_TRUE(list.LocateFile(1, entry));
+  ASSERT_EQ(entry.node_, node);
+  ASSERT_EQ(entry.height_, 1);
+  SBSNode* split = node->ChooseSplit(narrow, 1, reserve);
+  ASSERT_NE(split, middle);
+  RealBounded div(split->Guard(), split->Guard());
+  ASSERT_NE(file->Compare(div), BOverlap);
+}
+
+TEST(SBSTest, DeferredRebalance) {
+  sagitrs::SBSOptions options;
+  options.deferred_rebalance_ = 1;
+  sagitrs::SBSkiplist list(options);
+  for (size_t i = 100; i < 120; ++i)
+    list.Put(BuildFile(i, i));
+  ASSERT_GT(list.UnbalancedRoutes(), 0);
+  for (size_t i = 120; i < 400; ++i) {
+    list.Put(BuildFile(i, i));
+    list.Rebalance(1);
+  }
+  ASSERT_EQ(list.Rebalance(1000), 0);
+  auto iter = list.NewIterator();
+  for (size_t h = 1; h + 1 < iter->SBSHeight(); ++h)
+    for (iter->SeekToFirst(h); iter->Valid(); iter->Next())
+      ASSERT_EQ(iter->Current().TestState(options), 0);
+  delete iter;
+  BFileVec files;
+  list.LookupKey("250", files);
+  ASSERT_EQ(files.size(), 1);
+}
+
+TEST(SBSTest, PopBatch) {
+  sagitrs::SBSOptions options;
+  std::vector<BFile*> files, deleted;
+  {
+    sagitrs::SBSkiplist list(options);
+    for (size_t i = 100; i < 400; ++i)
+      list.Put(BuildFile(i, i));
+    for (size_t i = 100; i < 400; i += 10)
+      list.Put(BuildFile(i, i + 5));
+    for (size_t i = 100; i < 400; i += 2)
+      files.push_back(BuildFile(i, i));
+    for (size_t i = 100; i < 400; i += 20)
+      files.push_back(BuildFile(i, i + 5));
+    list.PopBatch(files, deleted);
+    ASSERT_EQ(deleted.size(), 165);
+    BFileVec a, b;
+    list.LookupKey("251", a);
+    list.LookupKey("262", b);
+    ASSERT_EQ(a.size(), 2);
+    ASSERT_EQ(b.size(), 0);
+  }
+  for (auto file : files) delete file;
+  // popped files may still be guards until the tree is gone.
+  for (auto file : deleted) delete file;
+}
+
+TEST(SBSTest, FileIndex) {
+  sagitrs::SBSOptions options;
+  BFile* wide = BuildFile(100, 150);
+  BFile* probe = BuildFile(120, 120);
+  {
+    sagitrs::SBSkiplist list(options);
+    for (size_t i = 100; i < 200; ++i)
+      list.Put(BuildFile(i, i));
+    list.Put(wide);
+    FileIndex::Entry entry;
+    ASSERT_TRUE(list.LocateFile(wide->Identifier(), entry));
+    ASSERT_EQ(entry.file_, wide);
+    ASSERT_TRUE(entry.node_->GetLevel(entry.height_)->Contains(*wide));
+    ASSERT_TRUE(list.LocateFile(probe->Identifier(), entry));
+    ASSERT_EQ(entry.height_, 0);
+    ASSERT_EQ(list.Pop(*wide), wide);
+    ASSERT_FALSE(list.LocateFile(wide->Identifier(), entry));
+  }
+  delete probe;
+  delete wide;
+}
+
+TEST(SBSTest, TreeGrows) {
+  sagitrs::SBSOptions options;
+  options.width_[0] = 2;
+  options.width_[1] = 3;
+  options.width_[2] = 4;
+  sagitrs::SBSkiplist list(options);
+  for (size_t a = 1000; a < 1400; ++a)
+    list.Put(BuildFile(a, a));
+  // the top level of the head split, the head grew above it.
+  SBSNode* head = list.GetHead();
+  ASSERT_GT(head->Height(), options.kMaxHeight());
+  ASSERT_LE(head->Height(), options.MaxTreeHeight);
+  ASSERT_EQ(head->Next(head->Height() - 1), nullptr);
+  for (size_t a = 1000; a < 1400; ++a) {
+    BFileVec files;
+    list.LookupKey(std::to_string(a), files);
+    ASSERT_EQ(files.size(), 1);
+  }
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
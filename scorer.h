@@ -29,7 +29,7 @@ struct Scorer {
   Scorer(SBSNode* head) 
   : status_(head), is_updated_(false), max_score_(0), 
     node_(nullptr), height_(0) {}
-  ~Scorer() {}
+  virtual ~Scorer() {}
   virtual void Reset(double baseline) { 
     is_updated_ = 0;
     max_score_ = baseline;
@@ -37,6 +37,7 @@ struct Scorer {
   virtual double MaxScore() const { return max_score_; }
   virtual bool Update(SBSNode* node, size_t height) {
     //if (max_score_ == 1) return 0;
+    if (node->GetLevel(height)->reserved_) return 0;
     SetNode(node, height);
     double score = GetScore(node, height);
     if (score > max_score_) {
@@ -46,7 +47,9 @@ struct Scorer {
     }
     return 0;
   }
+  // Reserved nodes score 0 with every scorer.
   virtual double GetScore(SBSNode* node, size_t height) {
+    if (node->GetLevel(height)->reserved_) return 0;
     SetNode(node, height);
     return Calculate();
   }
@@ -60,7 +63,8 @@ struct Scorer {
     double score = 0;
     TreeInit();
     for (auto value : Buffer())
-      score += ValueCalculate(value);
+      if (!value->Reserved())
+        score += ValueCalculate(value);
     return score / Capacity();
   }
  // resources can be used.
@@ -88,6 +92,9 @@ struct Scorer {
   BFile* GetHottest(int64_t time) { 
     return node_->GetHottest(height_, time); 
   }
+  const HotRanges& GetHotRanges(int64_t time) { 
+    return node_->GetHotRanges(height_, time); 
+  }
   const SBSOptions& Options() const { return node_->options_; }
   void GetChildren(sagitrs::BFileVec* children) {
     node_->GetChildGuard(height_, children);
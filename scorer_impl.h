@@ -7,9 +7,59 @@
 #include "sbs_node.h"
 #include "sbs_iterator.h"
 #include "delineator.h"
+#include "scorer.h"
 
 namespace sagitrs {
 
 struct Scorer;
 
+// Scores read from the table computed by SBSIterator::UpdateTable(),
+// a score above 1 means the node should be compacted. The weights of a 
+// CostModel make it the scorer of every policy.
+// The tables must be updated before picking.
+struct CostModelScorer : public Scorer {
+  CostModelScorer(SBSNode* head, const CostModel& model) 
+  : Scorer(head), model_(model) {}
+  // Runs covered by hole files over the runs the cost model allows.
+  double RunScore(TableVariableName runs = HoleFileRuns) const {
+    auto& table = VTable();
+    double capacity = std::max<uint64_t>(table[HoleFileCapacity], 100);
+    return 100.0 * table[runs] / capacity;
+  }
+  double SizeScore() const { return VTable()[FileSizeScore] / 100.0; }
+  double WidthScore() const { return VTable()[NodeWidthScore] / 100.0; }
+  // Read-triggered, see ReadSeekScore.
+  double SeekScore() const { return VTable()[ReadSeekScore] / 100.0; }
+  // Tombstone-heavy buffers, see TombstoneCompactionDensity().
+  double TombstoneScore() const {
+    double density = Options().TombstoneCompactionDensity();
+    if (density <= 0) return 0;
+    return VTable()[TombstoneDensity] / 1000.0 / density;
+  }
+  // The top node without children, files flushed there have no runs.
+  double Level0Score() const {
+    if (!MayBeLevel0()) return 0;
+    return 1.0 * VTable()[HoleFileCount] / Options().Level0CompactionSize();
+  }
+  // The weights of the cost model scale the triggers: runs and wasted
+  // seeks cost gets against writes, a scan reads tape runs too and 
+  // steps over tombstones, and writes weighing more than gets wait 
+  // until a compaction is full. A model may weigh writes 0.
+  virtual double Calculate() override { 
+    double read = std::sqrt(model_.read_weight_ / std::max(model_.write_weight_, 0.01));
+    double scan = std::sqrt(model_.scan_weight_);
+    double size = model_.write_weight_ > model_.read_weight_ ? SizeScore() : 0;
+    TableVariableName runs = model_.scan_weight_ > 1 ? TotalFileRuns : HoleFileRuns;
+    return std::max({RunScore(runs) * read, size, WidthScore(), Level0Score(), 
+                     SeekScore() * read, TombstoneScore() * scan}); 
+  }
+ private:
+  const CostModel model_;
+};
+
+// The scorer of a policy, see SBSOptions::ScorerPolicy().
+inline Scorer* NewScorer(SBSNode* head, CostModel::Policy policy) {
+  return new CostModelScorer(head, CostModel::ForPolicy(policy));
+}
+
 }
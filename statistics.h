@@ -136,50 +136,138 @@ struct TTLQueue : public std::vector<Counter>, public Printable {
     }
   }
 };
+// Keeps the current time slice as it is and folds every completed slice
+// into an exponentially weighted moving average, so the record never
+// grows and two records merge with one weighted add per label.
+struct DecayCounter : public Printable {
+  double decay_;
+  int64_t create_time_, time_;
+  Counter current_;
+  std::array<double, DefaultCounterTypeMax> average_;
+  DecayCounter(double decay, int64_t time)
+  : decay_(decay), create_time_(time), time_(time),
+    current_(), average_() {}
+  virtual ~DecayCounter() {}
+  // Average per-slice value of all slices before the given one.
+  // This record is not modified, so it can be used on const targets.
+  double Average(uint32_t label, int64_t time) const {
+    if (time <= time_) return average_[label];
+    double avg = average_[label] * decay_ + current_[label] * (1 - decay_);
+    return avg * std::pow(decay_, time - time_ - 1);
+  }
+  void Advance(int64_t time) {
+    if (time <= time_) return;
+    for (size_t i = 0; i < DefaultCounterTypeMax; ++i)
+      average_[i] = Average(i, time);
+    current_.Clear();
+    time_ = time;
+  }
+  void Update(uint32_t label, int64_t diff, int64_t time) {
+    Advance(time);
+    if (time == time_)
+      current_[label] += diff;
+    else
+      average_[label] += diff * (1 - decay_);
+  }
+  // Estimated value of a completed time slice.
+  int64_t Get(uint32_t label, int64_t time) const {
+    return std::llround(Average(label, time + 1));
+  }
+  void Merge(const DecayCounter& counter) {
+    Advance(counter.time_);
+    for (size_t i = 0; i < DefaultCounterTypeMax; ++i)
+      average_[i] += counter.Average(i, time_);
+    if (counter.time_ == time_)
+      current_ += counter.current_;
+  }
+  void Scale(uint32_t label, int n, int m) {
+    current_.Scale(label, n, m);
+    average_[label] = average_[label] * n / m;
+  }
+  void Clear() {
+    time_ = create_time_;
+    current_.Clear();
+    average_.fill(0);
+  }
+  virtual void GetStringSnapshot(std::vector<KVPair>& snapshot) const override {
+    for (size_t i = 0; i < DefaultCounterTypeMax; ++i)
+      snapshot.emplace_back("E["+std::to_string(i)+"]", std::to_string(average_[i]));
+  }
+};
 struct Statistics : virtual public Printable {
  private:
   bool never_use_it_;
   StatisticsOptions options_;
-  TTLQueue queue_;
+  // only the backend chosen by the options is allocated.
+  TTLQueue* queue_;
+  DecayCounter* decay_;
   Counter history_;
+  bool Decayed() const { return decay_ != nullptr; }
  public:
  // a null statistics. never use it.
   Statistics() : never_use_it_(true),
-    options_(), queue_(0, 0), history_() {}
+    options_(), queue_(nullptr), decay_(nullptr), history_() {}
  // 
   Statistics(const StatisticsOptions& options, Statistable::TypeTime time) 
   : never_use_it_(false), options_(options), 
-    queue_(options_.TimeSliceMaximumSize(), time),
-    history_() {}
+    queue_(nullptr), decay_(nullptr), history_() {
+      if (options_.StatisticsBackend() == StatisticsOptions::DecayedAverage)
+        decay_ = new DecayCounter(options_.DecayPerTimeSlice(), time);
+      else
+        queue_ = new TTLQueue(options_.TimeSliceMaximumSize(), time);
+    }
   Statistics(const Statistics& src) 
-  : options_(src.options_),
-    queue_(src.queue_),
+  : never_use_it_(src.never_use_it_), options_(src.options_),
+    queue_(src.queue_ ? new TTLQueue(*src.queue_) : nullptr),
+    decay_(src.decay_ ? new DecayCounter(*src.decay_) : nullptr),
     history_(src.history_) {}
+  Statistics& operator=(const Statistics&) = delete;
+  // Bytes held by the record, with the decayed backend it does not 
+  // depend on TimeSliceMaximumSize().
+  size_t MemoryUsage() const {
+    size_t usage = sizeof(*this);
+    if (queue_) usage += sizeof(TTLQueue) + queue_->capacity() * sizeof(Counter);
+    if (decay_) usage += sizeof(DecayCounter);
+    return usage;
+  }
     
   virtual void CopyStatistics(const Statistics& target) {
-    queue_.Clear();
+    if (queue_) queue_->Clear();
+    if (decay_) decay_->Clear();
     history_.Clear();
     MergeStatistics(target);
   }
   virtual void UpdateTime(Statistable::TypeTime time) {
-    if (queue_.ed_time_ >= time) return;
+    if (Decayed()) {
+      decay_->Advance(time);
+      return;
+    }
+    if (queue_->ed_time_ >= time) return;
     Counter blank;
-    queue_.Push(time, blank);
+    queue_->Push(time, blank);
   }
   virtual void MergeStatistics(const Statistics& target) {
-    if (target.queue_.ed_time_ > queue_.ed_time_)
-      UpdateTime(target.queue_.ed_time_);
-    if (target.queue_.ed_time_ + options_.TimeSliceMaximumSize() > queue_.ed_time_)
-      queue_.Merge(target.queue_);
+    if (Decayed()) {
+      assert(target.Decayed());
+      decay_->Merge(*target.decay_);
+      history_ += target.history_;
+      return;
+    }
+    if (target.queue_->ed_time_ > queue_->ed_time_)
+      UpdateTime(target.queue_->ed_time_);
+    if (target.queue_->ed_time_ + options_.TimeSliceMaximumSize() > queue_->ed_time_)
+      queue_->Merge(*target.queue_);
     history_ += target.history_;
   }
   virtual void UpdateStatistics(Statistable::TypeLabel label, 
                                 Statistable::TypeData diff, 
                                 Statistable::TypeTime time) {
-    if (time != STATISTICS_ALL) {
+    if (time != STATISTICS_ALL && Decayed()) {
+      decay_->Update(label, diff, time);
+    } else if (time != STATISTICS_ALL) {
       UpdateTime(time);
-      if (time >= queue_.st_time_)
-        queue_[time][label] += diff;
+      if (time >= queue_->st_time_)
+        (*queue_)[time][label] += diff;
     }
     history_[label] += diff;
   }
@@ -190,28 +278,41 @@ struct Statistics : virtual public Printable {
     case STATISTICS_ALL:
       return history_[label];
     default:
-      if (queue_.TimeLegal(time)) 
-        return queue_[time][label];
+      if (Decayed())
+        return decay_->Get(label, time);
+      if (queue_->TimeLegal(time)) 
+        return (*queue_)[time][label];
       else
         return 0;
     }
   }
   virtual void ScaleStatistics(Statistable::TypeLabel label, 
                                int numerator, int denominator) {
+    if (Decayed()) {
+      for (uint32_t l = 0; l < DefaultCounterTypeMax; ++l)
+        if (label == DefaultCounterTypeMax || label == l) {
+          decay_->Scale(l, numerator, denominator);
+          history_.Scale(l, numerator, denominator);
+        }
+      return;
+    }
     if (label == DefaultCounterTypeMax) {
-      for (auto t = queue_.st_time_; t <= queue_.ed_time_; ++t) {
-        queue_[t] *= numerator;
-        queue_[t] /= denominator;
+      for (auto t = queue_->st_time_; t <= queue_->ed_time_; ++t) {
+        (*queue_)[t] *= numerator;
+        (*queue_)[t] /= denominator;
       }
       history_ *= numerator;
       history_ /= denominator;
     } else {
-      for (auto t = queue_.st_time_; t <= queue_.ed_time_; ++t)
-        queue_[t].Scale(label, numerator, denominator);
+      for (auto t = queue_->st_time_; t <= queue_->ed_time_; ++t)
+        (*queue_)[t].Scale(label, numerator, denominator);
       history_.Scale(label, numerator, denominator);
     }
   }
-  virtual ~Statistics() {}
+  virtual ~Statistics() {
+    delete queue_;
+    delete decay_;
+  }
 
   virtual void GetStringSnapshot(std::vector<KVPair>& snapshot) const override {
     //queue_.GetStringSnapshot(snapshot);
@@ -23,12 +23,16 @@ struct SubSBS {
   };
  private:
   SBSNode *head_, *prev_;
+  // node holding head_ at height_ + 1, if known.
+  SBSNode* parent_;
   size_t height_;
 
   std::vector<SBSNode*> next_level_;
   int overlap_begin_, overlap_end_;
   std::vector<LevelNode*> dlnodes_;
   std::vector<BFile*> dfiles_;
+  // files of the buffer left out of a partial compaction.
+  std::vector<BFile*> kept_;
   // recursive mode : remove node in next_level_[overlap_begin, overlap_end_].
   // normal mode: remove lnode in next_level[...].
 
@@ -36,8 +40,8 @@ struct SubSBS {
   size_t memory_usage_;
 
  public:
-  SubSBS(SBSNode* head, size_t height, SBSNode* prev)
-  : head_(head), prev_(prev), height_(height), 
+  SubSBS(SBSNode* head, size_t height, SBSNode* prev, SBSNode* parent = nullptr)
+  : head_(head), prev_(prev), parent_(parent), height_(height), 
     next_level_(), overlap_begin_(0), overlap_end_(0),
     level1_compaction_(height == 1),
     memory_usage_(0)
@@ -78,12 +82,18 @@ struct SubSBS {
       recursive.insert(file->number);
     
     const BFileVec& buffer = head_->GetLevel(height_)->buffer_;
-    RealBounded range(buffer);
+    BFileVec compacted;
     for (BFile* file : buffer) {
+      if (recursive.find(file->Identifier()) == recursive.end()) {
+        kept_.push_back(file);
+        continue;
+      }
       dfiles_.push_back(file);
-      assert(recursive.find(file->Identifier()) != recursive.end());
+      compacted.Add(file);
       recursive.erase(file->Identifier());
     }
+    assert(!compacted.empty());
+    RealBounded range(compacted);
 
     size_t counter = 0;
 
@@ -144,6 +154,9 @@ struct SubSBS {
       sagitrs::Statistics s(Options(), Options().NowTimeSlice());
       for (auto& file : gen.inherit) 
         s.MergeStatistics(*file);
+      // deletions of the old leaves were compacted away, the output
+      // metadata sets the count of the new file.
+      s.ScaleStatistics(KSDeleteCount, 0, 1);
       gen.file = new BFile(gen.f, s);
       memory_usage_ += sizeof(gen.file);
     }
@@ -180,7 +193,7 @@ struct SubSBS {
     Replace(node, height, lnode);
   }
   bool TreePut(BFile* file, SBSNode* node, size_t height) {
-    SBSNode *tail = head_->Next(height);
+    SBSNode *tail = node->Next(height);
     SBSNode* next = nullptr;
     if (height > 1) {
       for (SBSNode* n = node; n != tail; n = next) {
@@ -208,6 +221,8 @@ struct SubSBS {
     LevelNode* newhead = BuildLNode(nullptr, nullptr, head_->Next(height_));
     for (uint32_t i = TableVariableMin; i < TableVariableMax; ++i)
       newhead->table_[i] = oldhead->table_[i];
+    for (BFile* file : kept_)
+      newhead->Add(file);
     if (level1_compaction_) {
       // build nodes from gendata.
       // make sure gendata is sorted.
@@ -251,7 +266,7 @@ struct SubSBS {
     SBSNode* next = head_->Next(height_);
     size_t w1 = prev_ ? prev_->GeneralWidth(height_) : 0;
     size_t w2 = head_->GeneralWidth(height_);
-    if (head_->GetLevel(height_)->buffer_.size() == 0 && 
+    if (head_->GetLevel(height_)->buffer_.size() == 0 && kept_.empty() && 
         prev_ && head_->Height() == height_ + 1 && 
         (w2 < Options().MinWidth() || w1 < Options().MinWidth())) {
       // this lnode is better to be deleted.
@@ -259,6 +274,10 @@ struct SubSBS {
       Replace(head_, height_, nullptr);
       head_->DecHeight();
       delete newhead;
+      // prev_ takes the children, the parent has one child less.
+      prev_->GetLevel(height_)->SetDirty();
+      if (parent_)
+        parent_->GetLevel(height_ + 1)->SetDirty();
     } else {
       //auto lnode = BuildLNode(nullptr, nullptr, next);
       Replace(head_, height_, newhead);
@@ -285,7 +304,54 @@ struct SubSBS {
     assert(height_ == 1 || counter == recursive.size());
     return height_ == 1 || counter == recursive.size();
   }
+  // Move the only file of a trivial move edit from this node to the child
+  // TreePut() picks, or to a new leaf in level 1. The BFile, and so its
+  // statistics, is kept. See SBSkiplist::IsTrivialMove().
+  bool BuildMove(const BFileEdit& edit) {
+    LevelNode* old = head_->GetLevel(height_);
+    BFile* file = nullptr;
+    for (BFile* f : old->buffer_)
+      if (f->Data() == edit.moved_[0])
+        file = f;
+    if (file == nullptr) {
+      assert(false && "Moved file not found.");
+      return false;
+    }
+    LevelNode* lnode = BuildLNode(old, nullptr, nullptr);
+    lnode->Pop(*file);
+    lnode->reserved_ = false;
+    file->SetReserved(false);
+    Replace(head_, height_, lnode);
+    // the subtree lost a file, its parent is rescored as in Build().
+    if (parent_)
+      parent_->GetLevel(height_ + 1)->SetDirty();
+    if (!level1_compaction_) {
+      bool dive = TreePut(file, head_, height_);
+      assert(dive);
+      return dive;
+    }
+    // nothing is deleted from next level.
+    overlap_begin_ = -1;
+    for (int i = 0; i < next_level_.size(); ++i) {
+      const BFileVec& buffer = next_level_[i]->GetLevel(0)->buffer_;
+      if (!buffer.empty() && buffer.Compare(*file) == BLess)
+        overlap_begin_ = i;
+    }
+    overlap_end_ = overlap_begin_ + 1;
+    if (overlap_begin_ == -1) {
+      assert(head_->GetLevel(0)->buffer_.empty());
+      Replace(head_, 0, BuildLNode(nullptr, file, head_->Next(0)));
+    } else {
+      SBSNode* prev = next_level_[overlap_begin_];
+      SBSNode* node = new SBSNode(Options(), prev->Next(0));
+      node->Add(Options(), 0, file);
+      prev->SetNext(0, node);
+    }
+    return true;
+  }
   bool Build(const BFileEdit& edit) {
+    if (edit.IsTrivialMove())
+      return BuildMove(edit);
     std::vector<BFile*> newchild;
     std::set<uint64_t> child_buffer;
     bool ok = FindOverlap(edit.deleted_, child_buffer);
@@ -294,17 +360,20 @@ struct SubSBS {
     ok = BuildWith(newchild);
     assert(ok);
     ok = RemoveChild(child_buffer);
+    // the compaction is done, see SBSkiplist::PickCompactions().
+    for (BFile* file : dfiles_)
+      file->SetReserved(false);
     return ok;
   }
 
   bool CheckExist(SBSNode* list) {
-    auto iter = new SBSIterator(list);
+    SBSIterator iter(list);
     std::set<uint64_t> dnums;
     for (auto file : dfiles_) 
       dnums.insert(file->Identifier());
     
-    for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-      SBSNode* n = iter->Current().node_;
+    for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+      SBSNode* n = iter.Current().node_;
       for (int h = 0; h < n->Height(); ++h) {
         LevelNode* l = n->GetLevel(h);
         for (auto file : l->buffer_)
@@ -313,8 +382,8 @@ struct SubSBS {
       }
     }
     if (level1_compaction_) {
-      for (iter->SeekToFirst(0); iter->Valid(); iter->Next()) {
-        SBSNode* n = iter->Current().node_;
+      for (iter.SeekToFirst(0); iter.Valid(); iter.Next()) {
+        SBSNode* n = iter.Current().node_;
         for (int i = overlap_begin_ + 1; i < overlap_end_; ++i)
           if (i > 0 && n == next_level_[i]) 
             return 1;
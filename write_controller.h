@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include "options.h"
+#include "lockable.h"
+
+namespace sagitrs {
+
+// Turns the pressure on the tree into a continuous delay of writers,
+// instead of a binary slowdown at SlowDownScore() and stop at StopScore().
+// The pressure is the highest of
+// 1. the max score of the last pick, between SlowDownScore() and StopScore(),
+// 2. the hole files in level 0 (see SBSkiplist::Level0Size()) beyond
+//    their capacity, over Level0CompactionSize() more files,
+// 3. the pending compaction bytes, between PendingBytesSlowDown() and
+//    PendingBytesStop().
+// Writes are limited by a token bucket whose rate falls geometrically from
+// MaxWriteRate() at pressure 0 to MinWriteRate() at pressure 1; there is
+// no limit without pressure.
+// Usage: Update() after each compaction pick, and sleep for the result of
+// Delay() before each write batch.
+struct WriteController : public Lockable {
+ private:
+  SBSOptions options_;
+  double pressure_;
+  double rate_;        // bytes per second, 0 for unlimited.
+  double tokens_;      // may be negative, i.e. borrowed by delayed writers.
+  uint64_t last_refill_;
+ public:
+  WriteController(const SBSOptions& options) 
+  : options_(options), pressure_(0), rate_(0), tokens_(0), 
+    last_refill_(options.NowMicros()) {}
+
+  static double Ratio(double value, double low, double high) {
+    if (value <= low) return 0;
+    if (value >= high) return 1;
+    return (value - low) / (high - low);
+  }
+  double Pressure(double score, size_t level0, size_t level0_capacity, 
+                  uint64_t pending_bytes) const {
+    double slow = std::max(level0_capacity, options_.Level0CompactionSize());
+    double pressure = std::max({
+      Ratio(score, options_.SlowDownScore(), options_.StopScore()),
+      Ratio(level0, slow, slow + options_.Level0CompactionSize()),
+      Ratio(pending_bytes, options_.PendingBytesSlowDown(), options_.PendingBytesStop())});
+    return pressure;
+  }
+  void Update(double score, size_t level0, size_t level0_capacity, 
+              uint64_t pending_bytes) {
+    double pressure = Pressure(score, level0, level0_capacity, pending_bytes);
+    LockGuard guard(this, LockGuard::WriteLock);
+    Refill(options_.NowMicros());
+    pressure_ = pressure;
+    if (pressure <= 0) {
+      rate_ = 0;
+      tokens_ = 0;
+      return;
+    }
+    double max_rate = options_.MaxWriteRate(), min_rate = options_.MinWriteRate();
+    rate_ = max_rate * std::pow(min_rate / max_rate, pressure);
+  }
+  // Micros the writer of a batch of bytes should sleep.
+  uint64_t Delay(uint64_t bytes) {
+    LockGuard guard(this, LockGuard::WriteLock);
+    if (rate_ <= 0) return 0;
+    Refill(options_.NowMicros());
+    tokens_ -= bytes;
+    if (tokens_ >= 0) return 0;
+    return -tokens_ / rate_ * 1000000;
+  }
+  double Pressure() const { return pressure_; }
+  double Rate() const { return rate_; }
+ private:
+  void Refill(uint64_t now) {
+    if (now > last_refill_ && rate_ > 0) {
+      tokens_ += rate_ * (now - last_refill_) / 1000000;
+      // burst of at most one millisecond of writes.
+      tokens_ = std::min(tokens_, rate_ / 1000);
+    }
+    last_refill_ = now;
+  }
+};
+
+}